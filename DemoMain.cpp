@@ -1,17 +1,75 @@
+#include "Async.h"
 #include "HDRImage.h"
 #include "Pipeline.h"
+#include "TaskQueue.h"
 #include "TaskWorker.h"
+#include "Trace.h"
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
 
 using namespace verdant;
 
+namespace {
+// Builds the scene of a job and renders it. Jobs share the workers, so that
+// the BVH of one job is built while another one renders
+Async<> render_job(PathTracePipeline &pipeline, std::string file_name) {
+  co_await pipeline.get_scene()->build_bvh_async();
+  co_await pipeline.run_async(file_name);
+}
+
+// image.ppm stays as is for a single job, and becomes image_3.ppm for job 3
+std::string job_output_name(const std::string &name, int job, int jobs) {
+  if (jobs == 1) {
+    return name;
+  }
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos) {
+    return name + "_" + std::to_string(job);
+  }
+  return name.substr(0, dot) + "_" + std::to_string(job) + name.substr(dot);
+}
+} // namespace
+
 int main(int argc, char **argv) {
-  TaskWorker::init_default_workers();
   int samples = 32;
+  // Adaptive sampling is off unless a noise threshold is given
+  float noise_threshold = 0.0f;
+  int min_samples = 16;
+  // Progressive rendering, optionally limited to time_budget seconds
+  bool progressive = false;
+  double time_budget = 0.0;
+  SamplerKind sampler_kind = SamplerKind::Uniform;
+  FilterKind filter_kind = FilterKind::Box;
+  // Conversion of ppm output, which keeps linear radiance in pfm and exr
+  ToneMapOperator tone_map_operator = ToneMapOperator::Reinhard;
+  bool srgb = false;
+  // Every output variable, written as extra channels of exr output
+  bool aovs = false;
+  // Filter the noise of the output, guided by albedo and normals
+  bool denoise = false;
+  unsigned int seed = 0;
+  // One worker per available CPU unless given
+  int threads = 0;
+  bool pin_threads = false;
+  bool numa = false;
+  // Progress saved every checkpoint_interval seconds, if not empty, and
+  // continued from with --resume
+  std::string checkpoint_name;
+  double checkpoint_interval = 300.0;
+  bool resume = false;
+  // Chrome trace JSON of the run, if not empty
+  std::string trace_name;
+  // Scenes rendered one after the other on the same workers
+  int jobs = 1;
   std::string output_name = "image.ppm";
+  // Environment map and the format it is kept in memory
+  std::string hdr_sky_name;
+  TexelFormat hdr_format = TexelFormat::Float;
   std::shared_ptr<HDRImage> image;
 
   // --single x y
@@ -47,6 +105,150 @@ int main(int argc, char **argv) {
         std::cerr << "--samples missing argument" << std::endl;
         return -1;
       }
+    } else if (arg == "--noise-threshold") {
+      i += 1;
+      if (i < argc) {
+        noise_threshold = atof(argv[i]);
+      } else {
+        std::cerr << "--noise-threshold missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--min-samples") {
+      i += 1;
+      if (i < argc) {
+        min_samples = atoi(argv[i]);
+        if (min_samples <= 0) {
+          std::cerr << "--min-samples must be followed by a positive integer"
+                    << std::endl;
+          return -1;
+        }
+      } else {
+        std::cerr << "--min-samples missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--progressive") {
+      progressive = true;
+    } else if (arg == "--time-budget") {
+      i += 1;
+      if (i < argc) {
+        time_budget = atof(argv[i]);
+        progressive = true;
+      } else {
+        std::cerr << "--time-budget missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--sampler") {
+      i += 1;
+      if (i < argc && std::string(argv[i]) == "uniform") {
+        sampler_kind = SamplerKind::Uniform;
+      } else if (i < argc && std::string(argv[i]) == "sobol") {
+        sampler_kind = SamplerKind::Sobol;
+      } else {
+        std::cerr << "--sampler must be followed by uniform or sobol"
+                  << std::endl;
+        return -1;
+      }
+    } else if (arg == "--filter") {
+      i += 1;
+      std::string name = i < argc ? argv[i] : "";
+      if (name == "box") {
+        filter_kind = FilterKind::Box;
+      } else if (name == "tent") {
+        filter_kind = FilterKind::Tent;
+      } else if (name == "gaussian") {
+        filter_kind = FilterKind::Gaussian;
+      } else if (name == "mitchell") {
+        filter_kind = FilterKind::Mitchell;
+      } else {
+        std::cerr << "--filter must be followed by box, tent, gaussian or "
+                     "mitchell"
+                  << std::endl;
+        return -1;
+      }
+    } else if (arg == "--tonemap") {
+      i += 1;
+      std::string name = i < argc ? argv[i] : "";
+      if (name == "reinhard") {
+        tone_map_operator = ToneMapOperator::Reinhard;
+      } else if (name == "aces") {
+        tone_map_operator = ToneMapOperator::Aces;
+      } else if (name == "filmic") {
+        tone_map_operator = ToneMapOperator::Filmic;
+      } else {
+        std::cerr << "--tonemap must be followed by reinhard, aces or filmic"
+                  << std::endl;
+        return -1;
+      }
+    } else if (arg == "--srgb") {
+      srgb = true;
+    } else if (arg == "--aovs") {
+      aovs = true;
+    } else if (arg == "--denoise") {
+      denoise = true;
+    } else if (arg == "--checkpoint") {
+      i += 1;
+      if (i < argc) {
+        checkpoint_name = argv[i];
+      } else {
+        std::cerr << "--checkpoint missing file name" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--checkpoint-interval") {
+      i += 1;
+      if (i < argc) {
+        checkpoint_interval = atof(argv[i]);
+      } else {
+        std::cerr << "--checkpoint-interval missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--resume") {
+      resume = true;
+    } else if (arg == "--seed") {
+      i += 1;
+      if (i < argc) {
+        seed = strtoul(argv[i], nullptr, 10);
+      } else {
+        std::cerr << "--seed missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--threads" || arg == "-j") {
+      i += 1;
+      if (i < argc) {
+        threads = atoi(argv[i]);
+        if (threads <= 0) {
+          std::cerr << "--threads must be followed by a positive integer"
+                    << std::endl;
+          return -1;
+        }
+      } else {
+        std::cerr << "--threads missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--pin-threads") {
+      pin_threads = true;
+    } else if (arg == "--jobs") {
+      i += 1;
+      if (i < argc) {
+        jobs = atoi(argv[i]);
+        if (jobs <= 0) {
+          std::cerr << "--jobs must be followed by a positive integer"
+                    << std::endl;
+          return -1;
+        }
+      } else {
+        std::cerr << "--jobs missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--trace") {
+      i += 1;
+      if (i < argc) {
+        trace_name = std::string(argv[i]);
+      } else {
+        std::cerr << "--trace missing argument" << std::endl;
+        return -1;
+      }
+    } else if (arg == "--numa") {
+      numa = true;
     } else if (arg == "--output" || arg == "-o") {
       i += 1;
       if (i < argc) {
@@ -55,10 +257,24 @@ int main(int argc, char **argv) {
         std::cerr << "--output missing argument" << std::endl;
         return -1;
       }
+    } else if (arg == "--hdr-format") {
+      i += 1;
+      std::string name = i < argc ? argv[i] : "";
+      if (name == "float") {
+        hdr_format = TexelFormat::Float;
+      } else if (name == "half") {
+        hdr_format = TexelFormat::Half;
+      } else if (name == "rgb9e5") {
+        hdr_format = TexelFormat::Rgb9e5;
+      } else {
+        std::cerr << "--hdr-format must be followed by float, half or rgb9e5"
+                  << std::endl;
+        return -1;
+      }
     } else if (arg == "--hdr-sky") {
       i += 1;
       if (i < argc) {
-        image = std::make_shared<HDRImage>(argv[i]);
+        hdr_sky_name = argv[i];
       } else {
         std::cerr << "--hdr-sky missing argument" << std::endl;
         return -1;
@@ -66,22 +282,129 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (!trace_name.empty()) {
+    Trace::set_enabled(true);
+    Trace::set_thread_name("main");
+  }
+  TaskWorker::init_default_workers(threads, pin_threads, numa);
+  printf("Using %u worker threads%s\n", TaskWorker::get_default_worker_count(),
+         pin_threads ? " pinned to CPUs" : "");
+  TaskQueue &queue = TaskQueue::default_queue();
+  if (numa) {
+    printf("Using %u NUMA nodes\n", queue.get_node_count());
+  }
+
+  // Loaded on the workers, which decode its rows in parallel
+  if (!hdr_sky_name.empty()) {
+    image = std::make_shared<HDRImage>(hdr_sky_name, hdr_format);
+    if (!image->is_valid()) {
+      std::cerr << "Could not load " << hdr_sky_name << std::endl;
+      return -1;
+    }
+    printf("Loaded %s, %dx%d with %d mip levels in %.1f MB\n",
+           hdr_sky_name.c_str(), image->get_width(), image->get_height(),
+           image->get_level_count(), image->get_memory_size() / 1048576.0);
+  }
+
   if (single_shot) {
     printf("Single shot pixel %d %d\n", x, y);
   } else {
     printf("Sample count is %d\n", samples);
   }
-  PathTracePipeline pipeline(320 * 4, 240 * 4, samples);
-  if (image) {
-    pipeline.get_scene()->set_sky_light(true, image);
+  std::vector<std::unique_ptr<PathTracePipeline>> pipelines;
+  for (int job = 0; job < jobs; job++) {
+    auto pipeline =
+        std::make_unique<PathTracePipeline>(320 * 4, 240 * 4, samples);
+    if (noise_threshold > 0.0f) {
+      pipeline->set_adaptive_sampling(noise_threshold, min_samples);
+    }
+    if (progressive) {
+      pipeline->set_progressive(true, time_budget);
+    }
+    pipeline->set_sampler(sampler_kind);
+    pipeline->get_film()->set_filter(Filter(filter_kind));
+    pipeline->get_film()->set_tone_mapper(ToneMapper(tone_map_operator, srgb));
+    if (aovs) {
+      pipeline->get_film()->set_aovs({true, true, true, true, true});
+    }
+    if (denoise) {
+      pipeline->set_denoise(true);
+    }
+    // Consecutive jobs render like frames of an animation
+    pipeline->set_seed(seed + job);
+    if (!checkpoint_name.empty()) {
+      std::string name = job_output_name(checkpoint_name, job, jobs);
+      pipeline->set_checkpoint(name, checkpoint_interval);
+      // The same command line can be rerun until the render completes, the
+      // first run finds no checkpoint and starts over. Checkpoints of other
+      // output variables are not usable either
+      if (resume) {
+        if (pipeline->resume(name)) {
+          auto film = pipeline->get_film();
+          printf("Resumed %s at %.2f samples per pixel\n", name.c_str(),
+                 (double)film->get_total_sample_count() /
+                     (film->get_width() * film->get_height()));
+        } else {
+          printf("No checkpoint to resume in %s, starting over\n",
+                 name.c_str());
+        }
+      }
+    }
+    if (image) {
+      pipeline->get_scene()->set_sky_light(true, image);
+    }
+    pipelines.push_back(std::move(pipeline));
+  }
+  if (noise_threshold > 0.0f) {
+    printf("Adaptive sampling with noise threshold %g\n", noise_threshold);
   }
-  pipeline.get_scene()->build_bvh();
 
+  auto render_start = std::chrono::steady_clock::now();
   if (single_shot) {
-    pipeline.single_pixel(x, y);
+    pipelines[0]->get_scene()->build_bvh();
+    pipelines[0]->single_pixel(x, y);
   } else {
-    pipeline.run(output_name);
+    std::vector<Async<>> renders;
+    for (int job = 0; job < jobs; job++) {
+      renders.push_back(
+          render_job(*pipelines[job], job_output_name(output_name, job, jobs)));
+    }
+    for (const Async<> &render : renders) {
+      render.get();
+    }
   }
   TaskWorker::shutdown_default_workers();
+  std::chrono::duration<double> render_time =
+      std::chrono::steady_clock::now() - render_start;
+
+  if (!trace_name.empty() && Trace::write_chrome_json(trace_name)) {
+    printf("Wrote trace to %s\n", trace_name.c_str());
+  }
+
+  if (numa) {
+    // Utilization per node shows how well rendering scales across sockets
+    for (unsigned int node = 0; node < queue.get_node_count(); node++) {
+      TaskQueue::NodeStats stats = queue.get_node_stats(node);
+      double capacity = stats.workers * render_time.count();
+      double busy = capacity > 0.0 ? stats.busy_seconds / capacity : 0.0;
+      printf("Node %u: %u workers, %llu tasks (%llu remote), %.1f%% busy\n",
+             node, stats.workers, stats.tasks, stats.remote_tasks,
+             busy * 100.0);
+    }
+  }
+
+  for (int job = 0; job < jobs && !single_shot; job++) {
+    std::string prefix = jobs > 1 ? "Job " + std::to_string(job) + ": " : "";
+    if (progressive) {
+      printf("%sCompleted %u samples per pixel\n", prefix.c_str(),
+             pipelines[job]->get_completed_samples());
+    }
+    if (noise_threshold > 0.0f) {
+      auto film = pipelines[job]->get_film();
+      printf("%sAverage samples per pixel %.2f\n", prefix.c_str(),
+             (double)film->get_total_sample_count() /
+                 (film->get_width() * film->get_height()));
+    }
+  }
   return 0;
 }
@@ -0,0 +1,76 @@
+#pragma once
+#include "MathDefs.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace verdant {
+// Parts of the radiance of a pixel, split by how the path left the first
+// surface it hit. They sum to the radiance
+enum class Lobe {
+  // Emission of the first surface, or the sky seen directly
+  Emission,
+  // Light scattered by a non-specular first surface
+  Diffuse,
+  // Light reflected or refracted by a specular first surface
+  Specular
+};
+
+const int lobe_count = 3;
+
+// Arbitrary output variables kept by the film next to the radiance. Each one
+// costs memory and integrator work only when enabled
+struct AovSettings {
+  // Reflectance at the first non-specular hit, tinted by specular bounces
+  // before it. Stored as half floats
+  bool albedo = false;
+  // World space normal at the first non-specular hit. Stored as half floats
+  bool normal = false;
+  // Distance along the camera ray to the first hit, the minimum over the
+  // samples of a pixel. Infinite for the sky. Stored as floats
+  bool depth = false;
+  // Index of the first primitive hit, of the first sample of a pixel that
+  // hit one. Stored as uint32
+  bool primitive_id = false;
+  // Radiance per Lobe. Stored as half floats
+  bool lobes = false;
+
+  bool any() const {
+    return albedo || normal || depth || primitive_id || lobes;
+  }
+};
+
+// Primitive id of pixels where no sample hit anything
+const uint32_t no_primitive = 0xffffffffu;
+
+// Values of the output variables for a single path, filled by PathTracer
+struct AovSample {
+  float3 albedo = float3::ZERO;
+  float3 normal = float3::ZERO;
+  float depth = INFINITY;
+  uint32_t primitive_id = no_primitive;
+  float3 lobes[lobe_count] = {float3::ZERO, float3::ZERO, float3::ZERO};
+};
+
+// Output variables of the samples of a pixel, summed except for depth and
+// primitive id, which are reduced like in the film
+struct AovSums {
+  float3 albedo = float3::ZERO;
+  float3 normal = float3::ZERO;
+  float depth = INFINITY;
+  uint32_t primitive_id = no_primitive;
+  float3 lobes[lobe_count] = {float3::ZERO, float3::ZERO, float3::ZERO};
+
+  void add(const AovSample &sample) {
+    albedo += sample.albedo;
+    normal += sample.normal;
+    depth = std::min(depth, sample.depth);
+    if (primitive_id == no_primitive) {
+      primitive_id = sample.primitive_id;
+    }
+    for (int k = 0; k < lobe_count; k++) {
+      lobes[k] += sample.lobes[k];
+    }
+  }
+};
+} // namespace verdant
@@ -0,0 +1,157 @@
+#pragma once
+#include "TaskQueue.h"
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace verdant {
+/**
+ * @brief Suspends a coroutine until tasks finished, then resumes it in a task
+ * on the default queue. Never blocks a thread
+ *
+ */
+class TaskAwaiter {
+public:
+  TaskAwaiter(std::vector<TaskHandle> tasks, TaskPriority priority,
+              bool always_suspend = false)
+      : tasks(std::move(tasks)), priority(priority),
+        always_suspend(always_suspend) {}
+
+  bool await_ready() const {
+    if (always_suspend) {
+      return false;
+    }
+    for (const TaskHandle &task : tasks) {
+      if (task && !task.is_done()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void await_suspend(std::coroutine_handle<> coroutine) {
+    // Not cancellable, a coroutine that is never resumed would leak
+    TaskQueue::default_queue().enqueue_await_all(
+        [coroutine]() { coroutine.resume(); }, tasks,
+        {priority, CancellationToken()});
+  }
+
+  void await_resume() const {}
+
+private:
+  std::vector<TaskHandle> tasks;
+  TaskPriority priority;
+  bool always_suspend;
+};
+
+inline TaskAwaiter operator co_await(const TaskHandle &task) {
+  return TaskAwaiter({task}, TaskPriority::Normal);
+}
+
+// Awaits a group of tasks, resuming with the given priority
+inline TaskAwaiter when_all(std::vector<TaskHandle> tasks,
+                            TaskPriority priority = TaskPriority::Normal) {
+  return TaskAwaiter(std::move(tasks), priority);
+}
+
+// Moves the rest of the coroutine onto a worker
+inline TaskAwaiter resume_on_worker(TaskPriority priority =
+                                        TaskPriority::Normal) {
+  return TaskAwaiter({}, priority, true);
+}
+
+template <typename T = void> class Async;
+
+namespace detail {
+template <typename T> struct AsyncState {
+  std::optional<T> value;
+  std::exception_ptr error;
+};
+
+template <> struct AsyncState<void> {
+  std::exception_ptr error;
+};
+
+template <typename T> struct AsyncPromiseBase {
+  // Result and completion outlive the coroutine frame, which is destroyed as
+  // soon as the coroutine returns
+  std::shared_ptr<AsyncState<T>> state = std::make_shared<AsyncState<T>>();
+  TaskHandle done = TaskQueue::default_queue().enqueue_held([]() {});
+
+  ~AsyncPromiseBase() { TaskQueue::default_queue().release_hold(done); }
+
+  Async<T> get_return_object();
+  std::suspend_never initial_suspend() noexcept { return {}; }
+  std::suspend_never final_suspend() noexcept { return {}; }
+  void unhandled_exception() { state->error = std::current_exception(); }
+};
+
+template <typename T> struct AsyncPromise : AsyncPromiseBase<T> {
+  void return_value(T value) { this->state->value = std::move(value); }
+};
+
+template <> struct AsyncPromise<void> : AsyncPromiseBase<void> {
+  void return_void() {}
+};
+} // namespace detail
+
+/**
+ * @brief Result of a coroutine that runs on the task system. It starts right
+ * away on the calling thread, and continues on workers after every co_await
+ * that suspends it
+ *
+ * Dropping an Async does not cancel the coroutine. Its task finishes when the
+ * coroutine returned, so it can be a prerequisite of other tasks, or be
+ * awaited by other coroutines.
+ *
+ */
+template <typename T> class Async {
+public:
+  using promise_type = detail::AsyncPromise<T>;
+
+  Async(std::shared_ptr<detail::AsyncState<T>> state, TaskHandle done)
+      : state(std::move(state)), done(std::move(done)) {}
+
+  const TaskHandle &get_task() const { return done; }
+  bool is_done() const { return done.is_done(); }
+
+  // Waits for the coroutine as TaskQueue::wait does, and returns its result
+  // or rethrows its exception
+  T get() const {
+    TaskQueue::default_queue().wait(done);
+    return result();
+  }
+
+  auto operator co_await() const {
+    struct Awaiter : TaskAwaiter {
+      Async async;
+      Awaiter(const Async &async)
+          : TaskAwaiter({async.done}, TaskPriority::Normal), async(async) {}
+      T await_resume() const { return async.result(); }
+    };
+    return Awaiter(*this);
+  }
+
+private:
+  T result() const {
+    if (state->error) {
+      std::rethrow_exception(state->error);
+    }
+    if constexpr (!std::is_void_v<T>) {
+      return *state->value;
+    }
+  }
+
+  std::shared_ptr<detail::AsyncState<T>> state;
+  TaskHandle done;
+};
+
+template <typename T>
+Async<T> detail::AsyncPromiseBase<T>::get_return_object() {
+  return Async<T>(state, done);
+}
+} // namespace verdant
@@ -44,6 +44,15 @@ public:
   float3 get_max() const { return max_; }
   float3 get_extent() const { return max_ - min_; }
 
+  float surface_area() const {
+    float3 d = get_extent();
+    return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+  }
+
+  bool is_empty() const {
+    return min_.x() > max_.x() || min_.y() > max_.y() || min_.z() > max_.z();
+  }
+
   bool contains(const float3 &p) const {
     for (int i = 0; i < 3; i++) {
       if (!(min_[i] <= p[i] && p[i] <= max_[i])) {
@@ -1,7 +1,25 @@
 #include "BVH.h"
+#include "Parallel.h"
 #include "Scene.h"
+#include <memory>
+#include <utility>
+
+namespace {
+// Below this many primitives a node is built on a single thread
+const size_t parallel_build_threshold = 4096;
+
+using NodeBounds = std::pair<verdant::BBox3, verdant::BBox3>;
+} // namespace
 
 namespace verdant {
+BVHNode::BVHNode(const BVHNode &other)
+    : bounds(other.bounds), items(other.items) {
+  if (other.left) {
+    left = std::make_unique<BVHNode>(*other.left);
+    right = std::make_unique<BVHNode>(*other.right);
+  }
+}
+
 bool BVHNode::intersect(const Ray &ray, Intersection &isect) const {
   if (!bounds.intersect(ray))
     return false;
@@ -25,20 +43,30 @@ bool BVH::intersect(const Ray &ray, Intersection &isect) const {
 
 BBox3 BVH::get_bounds() const { return root->get_bounds(); }
 
-BVHNode *BVH::build_from(std::vector<Primitive *> prims, int max_leaf_size) {
-  BBox3 centroid_box, bbox;
-
-  for (Primitive *p : prims) {
-    BBox3 bb = p->get_bounds();
-    bbox.expand(bb);
-    float3 c = bb.centroid();
-    centroid_box.expand(c);
-  }
+std::unique_ptr<BVHNode> BVH::build_from(std::vector<Primitive *> prims,
+                                         int max_leaf_size) {
+  // Bounds of the primitives and of their centroids
+  NodeBounds node_bounds = parallel_reduce(
+      0, prims.size(), parallel_build_threshold, NodeBounds(),
+      [&prims](size_t begin, size_t end, NodeBounds b) {
+        for (size_t i = begin; i < end; i++) {
+          BBox3 bb = prims[i]->get_bounds();
+          b.first.expand(bb);
+          b.second.expand(bb.centroid());
+        }
+        return b;
+      },
+      [](NodeBounds a, const NodeBounds &b) {
+        a.first.expand(b.first);
+        a.second.expand(b.second);
+        return a;
+      });
+  BBox3 bbox = node_bounds.first;
+  BBox3 centroid_box = node_bounds.second;
 
   if (prims.size() <= max_leaf_size || prims.size() == 1) {
     // This is a leaf node
-    BVHNode *node = new BVHNode(bbox, prims);
-    return node;
+    return std::make_unique<BVHNode>(bbox, std::move(prims));
   }
 
   // TODO: implement surface area huristic
@@ -58,8 +86,18 @@ BVHNode *BVH::build_from(std::vector<Primitive *> prims, int max_leaf_size) {
       right_prims.push_back(p);
   }
 
-  BVHNode *node = new BVHNode(bbox, build_from(left_prims, max_leaf_size),
-                              build_from(right_prims, max_leaf_size));
-  return node;
+  // Large subtrees are built concurrently
+  std::unique_ptr<BVHNode> children[2];
+  size_t grain = prims.size() > parallel_build_threshold ? 1 : 2;
+  parallel_for(0, 2, grain, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      children[i] = build_from(i == 0 ? std::move(left_prims)
+                                      : std::move(right_prims),
+                               max_leaf_size);
+    }
+  });
+
+  return std::make_unique<BVHNode>(bbox, std::move(children[0]),
+                                   std::move(children[1]));
 }
 } // namespace verdant
@@ -1,6 +1,7 @@
 #pragma once
 #include "BBox3.h"
 #include "MathDefs.h"
+#include <memory>
 #include <vector>
 
 namespace verdant {
@@ -11,33 +12,47 @@ class Primitive;
 class BVHNode {
 public:
   BVHNode(BBox3 bounds, std::vector<Primitive *> items)
-      : bounds(bounds), left(nullptr), right(nullptr), items(std::move(items)) {
-  }
+      : bounds(bounds), items(std::move(items)) {}
 
-  BVHNode(BBox3 bounds, BVHNode *left, BVHNode *right)
-      : bounds(bounds), left(left), right(right) {}
+  BVHNode(BBox3 bounds, std::unique_ptr<BVHNode> left,
+          std::unique_ptr<BVHNode> right)
+      : bounds(bounds), left(std::move(left)), right(std::move(right)) {}
+
+  // Copies the whole subtree
+  BVHNode(const BVHNode &other);
 
   const BBox3 &get_bounds() const { return bounds; }
   bool intersect(const Ray &ray, Intersection &isect) const;
 
 private:
   BBox3 bounds;
-  BVHNode *left;
-  BVHNode *right;
+  std::unique_ptr<BVHNode> left;
+  std::unique_ptr<BVHNode> right;
   std::vector<Primitive *> items;
 };
 
 class BVH {
 public:
   BVH() = default;
-  explicit BVH(std::vector<Primitive *> items) { root = build_from(items, 4); }
-
+  explicit BVH(std::vector<Primitive *> items)
+      : root(build_from(std::move(items), 4)) {}
+
+  // Deep copies, made on the calling thread alone, so that first touch puts
+  // every node of the copy in the memory of that thread
+  BVH(const BVH &other)
+      : root(other.root ? std::make_unique<BVHNode>(*other.root) : nullptr) {}
+  BVH &operator=(const BVH &other) { return *this = BVH(other); }
+  BVH(BVH &&other) = default;
+  BVH &operator=(BVH &&other) = default;
+
+  bool empty() const { return !root; }
   bool intersect(const Ray &ray, Intersection &isect) const;
   BBox3 get_bounds() const;
 
 private:
-  static BVHNode *build_from(std::vector<Primitive *> items, int max_leaf_size);
+  static std::unique_ptr<BVHNode> build_from(std::vector<Primitive *> items,
+                                             int max_leaf_size);
 
-  BVHNode *root{};
+  std::unique_ptr<BVHNode> root;
 };
 } // namespace verdant
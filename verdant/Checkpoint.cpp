@@ -0,0 +1,120 @@
+#include "Checkpoint.h"
+#include "Trace.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace {
+const char magic[8] = {'V', 'R', 'D', 'C', 'K', 'P', 'T', '\n'};
+const uint32_t version = 1;
+// Reads back as another value on machines of the other byte order
+const uint32_t byte_order = 0x01020304u;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t sampler_kind;
+  uint32_t seed;
+  uint32_t filter_kind;
+  float filter_radius;
+};
+} // namespace
+
+namespace verdant {
+bool Checkpoint::write(const std::string &file_name,
+                       const CheckpointSettings &settings, const Film &film) {
+  std::vector<unsigned char> bytes;
+  encode(settings, film, bytes);
+  return write(file_name, bytes);
+}
+
+void Checkpoint::encode(const CheckpointSettings &settings, const Film &film,
+                        std::vector<unsigned char> &bytes) {
+  TraceScope scope("checkpoint encode");
+  Header header;
+  memcpy(header.magic, magic, sizeof(magic));
+  header.version = version;
+  header.byte_order = byte_order;
+  header.sampler_kind = (uint32_t)settings.sampler_kind;
+  header.seed = settings.seed;
+  header.filter_kind = (uint32_t)settings.filter_kind;
+  header.filter_radius = settings.filter_radius;
+
+  bytes.resize(sizeof(header));
+  memcpy(bytes.data(), &header, sizeof(header));
+  film.write_state(bytes);
+}
+
+bool Checkpoint::write(const std::string &file_name,
+                       const std::vector<unsigned char> &bytes) {
+  TraceScope scope("checkpoint write");
+  std::string temp_name = file_name + ".tmp";
+  FILE *file = fopen(temp_name.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  // The rename may reach the disk before the data otherwise, and a crash in
+  // between would leave a truncated file in place of the previous one
+  written = written && fflush(file) == 0;
+#if defined(__unix__) || defined(__APPLE__)
+  written = written && fsync(fileno(file)) == 0;
+#endif
+  if (fclose(file) != 0 || !written) {
+    remove(temp_name.c_str());
+    return false;
+  }
+  return rename(temp_name.c_str(), file_name.c_str()) == 0;
+}
+
+bool Checkpoint::read(const std::string &file_name,
+                      CheckpointSettings &settings, Film &film) {
+  TraceScope scope("checkpoint read");
+  FILE *file = fopen(file_name.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  std::vector<unsigned char> bytes;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long size = ftell(file);
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+      bytes.resize(size);
+      if (fread(bytes.data(), 1, size, file) != (size_t)size) {
+        bytes.clear();
+      }
+    }
+  }
+  fclose(file);
+
+  Header header;
+  if (bytes.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, bytes.data(), sizeof(header));
+  if (memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+      header.version != version || header.byte_order != byte_order) {
+    return false;
+  }
+  // Corrupt settings would reach switches over the kinds unchecked. A radius
+  // of 0 stands for the default of the filter
+  if (header.sampler_kind > (uint32_t)SamplerKind::Sobol ||
+      header.filter_kind > (uint32_t)FilterKind::Mitchell ||
+      !std::isfinite(header.filter_radius) || header.filter_radius < 0.0f) {
+    return false;
+  }
+  if (!film.read_state(bytes.data() + sizeof(header),
+                       bytes.data() + bytes.size())) {
+    return false;
+  }
+  settings.sampler_kind = (SamplerKind)header.sampler_kind;
+  settings.seed = header.seed;
+  settings.filter_kind = (FilterKind)header.filter_kind;
+  settings.filter_radius = header.filter_radius;
+  return true;
+}
+} // namespace verdant
@@ -0,0 +1,53 @@
+#pragma once
+#include "Film.h"
+#include "Filter.h"
+#include "Sampler.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace verdant {
+// Settings that decide which samples a render takes. Samples of a checkpoint
+// only continue a render with the same settings
+struct CheckpointSettings {
+  SamplerKind sampler_kind = SamplerKind::Uniform;
+  uint32_t seed = 0;
+  FilterKind filter_kind = FilterKind::Box;
+  float filter_radius = 0.0f;
+
+  bool operator==(const CheckpointSettings &) const = default;
+};
+
+/**
+ * @brief Saves and restores the progress of a render: the state of its film
+ * and the settings of its sampler. The values of a path only depend on the
+ * pixel, its sample index and the seed, so a resumed render takes the same
+ * samples as one that was never stopped
+ *
+ * Files are in host byte order, and only read on machines of the same
+ * byte order. Functions return false if the file could not be accessed.
+ *
+ */
+class Checkpoint {
+public:
+  // Writes a temporary file next to file_name, flushes it to disk and
+  // renames it over file_name, so that a process or machine dying while
+  // writing keeps the previous checkpoint
+  static bool write(const std::string &file_name,
+                    const CheckpointSettings &settings, const Film &film);
+
+  // The two halves of write. encode only copies memory, so a render needs to
+  // stop changing film just while it runs, and not while the file is written.
+  // bytes is replaced, keeping its capacity
+  static void encode(const CheckpointSettings &settings, const Film &film,
+                     std::vector<unsigned char> &bytes);
+  static bool write(const std::string &file_name,
+                    const std::vector<unsigned char> &bytes);
+
+  // Also returns false if the file is not a checkpoint, holds settings out of
+  // range or was saved from a film of another size or other output
+  // variables, leaving film unchanged
+  static bool read(const std::string &file_name, CheckpointSettings &settings,
+                   Film &film);
+};
+} // namespace verdant
@@ -0,0 +1,320 @@
+#include "Denoiser.h"
+#include "Parallel.h"
+#include "Trace.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace {
+// B3 spline, the 1D kernel of every pass
+const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+// Pixels of a row filtered together
+const int block_size = 64;
+
+// Albedo is clamped to this before dividing by it
+const float min_albedo = 1e-3f;
+
+// Clamps negative values to 0 by clearing them with integer operations. GCC
+// does not vectorize a float select followed by arithmetic, since under
+// -ftrapping-math it moves the arithmetic into one branch of the select
+float clamp_negative(float x) {
+  int32_t bits = std::bit_cast<int32_t>(x);
+  return std::bit_cast<float>(bits & ~(bits >> 31));
+}
+
+// e^x for x <= 0 within 1e-5 relative error, from integer operations and a
+// polynomial, so that loops calling it vectorize without libmvec
+float fast_exp(float x) {
+  // Floats below -80 compare greater as unsigned bits, clamp them to -80
+  x = std::bit_cast<float>(
+      std::min(std::bit_cast<uint32_t>(x), std::bit_cast<uint32_t>(-80.0f)));
+  // 2^t = 2^i * 2^f with f in [0, 1]. Truncation rounds up negative t, so
+  // step i down for those, which gives f = 1 at integers
+  float t = x * 1.44269504f;
+  int32_t i = (int32_t)t - (int32_t)(std::bit_cast<uint32_t>(t) >> 31);
+  float f = t - (float)i;
+  // Fit of 2^f on [0, 1]
+  float p =
+      1.00000252f +
+      f * (0.693006621f +
+           f * (0.241427493f + f * (0.0520374288f + f * 0.0135206032f)));
+  return std::bit_cast<float>(std::bit_cast<int32_t>(p) + (i << 23));
+}
+
+float luminance(float r, float g, float b) {
+  return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// Channels of an image, each with a margin of replicated edge pixels so that
+// filter taps need no bounds checks
+class PaddedImage {
+public:
+  PaddedImage(int width, int height, int margin, int channels)
+      : width(width), height(height), margin(margin),
+        pitch(width + 2 * margin),
+        planes(channels, std::vector<float>(
+                             (size_t)pitch * (height + 2 * margin))) {}
+
+  int get_pitch() const { return pitch; }
+
+  // Pixel 0 of row y, which may lie up to margin outside the image
+  float *row(int channel, int y) {
+    return &planes[channel][(size_t)(y + margin) * pitch + margin];
+  }
+
+  void swap(PaddedImage &other) { planes.swap(other.planes); }
+
+  // Replicates the edges of the image into the margin
+  void pad() {
+    for (std::vector<float> &plane : planes) {
+      float *data = plane.data();
+      verdant::parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+          float *r = data + (y + margin) * pitch;
+          std::fill(r, r + margin, r[margin]);
+          std::fill(r + margin + width, r + pitch, r[margin + width - 1]);
+        }
+      });
+      float *first = data + (size_t)margin * pitch;
+      float *last = data + (size_t)(margin + height - 1) * pitch;
+      for (int m = 0; m < margin; m++) {
+        std::copy(first, first + pitch, data + (size_t)m * pitch);
+        std::copy(last, last + pitch,
+                  data + (size_t)(margin + height + m) * pitch);
+      }
+    }
+  }
+
+private:
+  int width;
+  int height;
+  int margin;
+  int pitch;
+  std::vector<std::vector<float>> planes;
+};
+
+// Channels of the filtered image and of the guides
+enum { R, G, B, VARIANCE, COLOR_CHANNELS };
+enum { NX, NY, NZ, AR, AG, AB, GUIDE_CHANNELS };
+} // namespace
+
+namespace verdant {
+void Denoiser::run(const Film &film, Film &output) const {
+  TraceScope scope("denoise");
+  int width = film.get_width();
+  int height = film.get_height();
+  int iterations = std::clamp(settings.iterations, 0, 10);
+  // Widest offset of the last pass, and at least the 3x3 variance blur
+  int margin = std::max(2 << std::max(iterations - 1, 0), 2);
+
+  const AovSettings &aovs = film.get_aovs();
+  PaddedImage color(width, height, margin, COLOR_CHANNELS);
+  PaddedImage next(width, height, margin, COLOR_CHANNELS);
+  PaddedImage guides(width, height, margin, GUIDE_CHANNELS);
+
+  // Divide by the albedo and take the variance of each pixel mean
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    for (int y = begin; y < (int)end; y++) {
+      for (int x = 0; x < width; x++) {
+        float3 a = aovs.albedo ? max(film.get_albedo(x, y),
+                                     float3(min_albedo, min_albedo, min_albedo))
+                               : float3(1, 1, 1);
+        // Without normals every pair of pixels faces the same way
+        float3 n = aovs.normal ? film.get_normal(x, y) : float3(0, 0, 1);
+        float3 c = film.get_radiance(x, y) / a;
+        unsigned int samples = film.get_sample_count(x, y);
+        float la = luminance(a.x(), a.y(), a.z());
+        // Negative until estimated from the neighbours below
+        float variance = samples >= 2 ? film.get_variance(x, y) / samples /
+                                            (la * la)
+                                      : -1.0f;
+
+        color.row(R, y)[x] = c.x();
+        color.row(G, y)[x] = c.y();
+        color.row(B, y)[x] = c.z();
+        color.row(VARIANCE, y)[x] = variance;
+        guides.row(NX, y)[x] = n.x();
+        guides.row(NY, y)[x] = n.y();
+        guides.row(NZ, y)[x] = n.z();
+        guides.row(AR, y)[x] = a.x();
+        guides.row(AG, y)[x] = a.y();
+        guides.row(AB, y)[x] = a.z();
+      }
+    }
+  });
+  color.pad();
+  guides.pad();
+
+  // Pixels with fewer than two samples, as in a first progressive pass, get
+  // the luminance variance of their 3x3 neighbourhood instead
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    for (int y = begin; y < (int)end; y++) {
+      float *variance = next.row(VARIANCE, y);
+      for (int x = 0; x < width; x++) {
+        variance[x] = color.row(VARIANCE, y)[x];
+        if (variance[x] >= 0.0f) {
+          continue;
+        }
+        float sum = 0.0f;
+        float sum_sq = 0.0f;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            float l = luminance(color.row(R, y + dy)[x + dx],
+                                color.row(G, y + dy)[x + dx],
+                                color.row(B, y + dy)[x + dx]);
+            sum += l;
+            sum_sq += l * l;
+          }
+        }
+        float mean = sum / 9;
+        variance[x] = std::max(sum_sq / 9 - mean * mean, 0.0f);
+      }
+    }
+  });
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    for (int y = begin; y < (int)end; y++) {
+      std::copy(next.row(VARIANCE, y), next.row(VARIANCE, y) + width,
+                color.row(VARIANCE, y));
+    }
+  });
+  color.pad();
+
+  int pitch = color.get_pitch();
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    int step = 1 << iteration;
+    parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+      const float sigma_luminance = settings.sigma_luminance;
+      const float inv_sigma_albedo =
+          1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+      // Sums of a block of pixels. Being local, the compiler knows they do
+      // not alias the images and vectorizes the loops without checks
+      alignas(64) float inv_sigma[block_size];
+      alignas(64) float sum_r[block_size];
+      alignas(64) float sum_g[block_size];
+      alignas(64) float sum_b[block_size];
+      alignas(64) float sum_v[block_size];
+      alignas(64) float sum_w[block_size];
+
+      for (int y = begin; y < (int)end; y++) {
+        for (int x0 = 0; x0 < width; x0 += block_size) {
+          int n = std::min(block_size, width - x0);
+          const float *cr = color.row(R, y) + x0;
+          const float *cg = color.row(G, y) + x0;
+          const float *cb = color.row(B, y) + x0;
+          const float *cv = color.row(VARIANCE, y) + x0;
+          const float *nx = guides.row(NX, y) + x0;
+          const float *ny = guides.row(NY, y) + x0;
+          const float *nz = guides.row(NZ, y) + x0;
+          const float *ar = guides.row(AR, y) + x0;
+          const float *ag = guides.row(AG, y) + x0;
+          const float *ab = guides.row(AB, y) + x0;
+
+          // Edge stopping width from the variance, blurred over 3x3 as in
+          // SVGF since single pixel estimates are noisy
+          for (int x = 0; x < n; x++) {
+            inv_sigma[x] = 0.0f;
+          }
+          for (int dy = -1; dy <= 1; dy++) {
+            const float *v = color.row(VARIANCE, y + dy) + x0;
+            for (int dx = -1; dx <= 1; dx++) {
+              float h = (dy == 0 ? 0.5f : 0.25f) * (dx == 0 ? 0.5f : 0.25f);
+              for (int x = 0; x < n; x++) {
+                inv_sigma[x] += h * v[x + dx];
+              }
+            }
+          }
+          for (int x = 0; x < n; x++) {
+            inv_sigma[x] =
+                1.0f / (sigma_luminance * std::sqrt(inv_sigma[x]) + 1e-4f);
+          }
+
+          // The center tap always counts fully
+          const float h_center = kernel[2] * kernel[2];
+          for (int x = 0; x < n; x++) {
+            sum_r[x] = h_center * cr[x];
+            sum_g[x] = h_center * cg[x];
+            sum_b[x] = h_center * cb[x];
+            sum_v[x] = h_center * h_center * cv[x];
+            sum_w[x] = h_center;
+          }
+
+          for (int ky = 0; ky < 5; ky++) {
+            for (int kx = 0; kx < 5; kx++) {
+              if (ky == 2 && kx == 2) {
+                continue;
+              }
+              float h = kernel[ky] * kernel[kx];
+              ptrdiff_t offset =
+                  (ptrdiff_t)(ky - 2) * step * pitch + (kx - 2) * step;
+              const float *tr = cr + offset;
+              const float *tg = cg + offset;
+              const float *tb = cb + offset;
+              const float *tv = cv + offset;
+              const float *tnx = nx + offset;
+              const float *tny = ny + offset;
+              const float *tnz = nz + offset;
+              const float *tar = ar + offset;
+              const float *tag = ag + offset;
+              const float *tab = ab + offset;
+              for (int x = 0; x < n; x++) {
+                float dl = fabsf(luminance(cr[x], cg[x], cb[x]) -
+                                 luminance(tr[x], tg[x], tb[x]));
+                float dar = ar[x] - tar[x];
+                float dag = ag[x] - tag[x];
+                float dab = ab[x] - tab[x];
+                float da = dar * dar + dag * dag + dab * dab;
+                // max(0, n . n')^128
+                float wn = clamp_negative(nx[x] * tnx[x] + ny[x] * tny[x] +
+                                          nz[x] * tnz[x]);
+                wn *= wn;
+                wn *= wn;
+                wn *= wn;
+                wn *= wn;
+                wn *= wn;
+                wn *= wn;
+                wn *= wn;
+                float w = h * wn *
+                          fast_exp(-dl * inv_sigma[x] - da * inv_sigma_albedo);
+                sum_r[x] += w * tr[x];
+                sum_g[x] += w * tg[x];
+                sum_b[x] += w * tb[x];
+                sum_v[x] += w * w * tv[x];
+                sum_w[x] += w;
+              }
+            }
+          }
+
+          float *out_r = next.row(R, y) + x0;
+          float *out_g = next.row(G, y) + x0;
+          float *out_b = next.row(B, y) + x0;
+          float *out_v = next.row(VARIANCE, y) + x0;
+          for (int x = 0; x < n; x++) {
+            float inv_w = 1.0f / sum_w[x];
+            out_r[x] = sum_r[x] * inv_w;
+            out_g[x] = sum_g[x] * inv_w;
+            out_b[x] = sum_b[x] * inv_w;
+            out_v[x] = sum_v[x] * inv_w * inv_w;
+          }
+        }
+      }
+    });
+    color.swap(next);
+    color.pad();
+  }
+
+  // Multiply the albedo back in
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    for (int y = begin; y < (int)end; y++) {
+      for (int x = 0; x < width; x++) {
+        float3 c(color.row(R, y)[x], color.row(G, y)[x], color.row(B, y)[x]);
+        float3 a(guides.row(AR, y)[x], guides.row(AG, y)[x],
+                 guides.row(AB, y)[x]);
+        output.set_radiance(x, y, c * a);
+      }
+    }
+  });
+}
+} // namespace verdant
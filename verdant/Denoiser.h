@@ -0,0 +1,38 @@
+#pragma once
+#include "Film.h"
+
+namespace verdant {
+struct DenoiserSettings {
+  // Passes of the 5x5 kernel, each one twice as wide as the previous
+  int iterations = 5;
+  // Luminance differences are tolerated up to this many standard deviations
+  // of the noise of a pixel
+  float sigma_luminance = 4.0f;
+  // Tolerated difference of albedo between pixels
+  float sigma_albedo = 0.1f;
+};
+
+/**
+ * @brief Edge-avoiding à-trous wavelet filter, as in Dammertz et al. and the
+ * spatial part of SVGF. Noise is smoothed within surfaces and kept from
+ * crossing edges, which are found from the albedo and normal outputs of the
+ * film and the variance of its pixels
+ *
+ * Radiance is divided by the albedo before filtering and multiplied back
+ * after, so that texture is not blurred. Films without albedo or normal
+ * outputs are filtered with luminance and variance alone.
+ *
+ */
+class Denoiser {
+public:
+  explicit Denoiser(const DenoiserSettings &settings = {})
+      : settings(settings) {}
+
+  // Filters the radiance of film into output, which must have the same size.
+  // Rows are filtered in parallel
+  void run(const Film &film, Film &output) const;
+
+private:
+  DenoiserSettings settings;
+};
+} // namespace verdant
@@ -0,0 +1,64 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+namespace verdant {
+// Polynomial stand-ins for atan2f and acosf, for lookups where a few
+// millionths of a radian do not matter, such as mapping directions to
+// texels. Octants and signs are unfolded with bit masks rather than
+// conditionals, which compilers turn into branches that mispredict on
+// random directions
+
+// Within 2.1e-6 radians of atan2f, with the same signs and quadrants. (0, 0)
+// gives 0. Undefined for NaN and infinite arguments
+inline float fast_atan2(float y, float x) {
+  float ax = std::fabs(x);
+  float ay = std::fabs(y);
+  // Fold into the first octant, where the ratio is in [0, 1]. The floor on
+  // the divisor keeps (0, 0) finite, and is off only for subnormals
+  float a = std::min(ax, ay) / std::max(std::max(ax, ay), FLT_MIN);
+  float a2 = a * a;
+  // Least squares fit of atan(a) / a in a^2 over [0, 1]
+  float r =
+      a * (0.999979834f +
+           a2 * (-0.332655483f +
+                 a2 * (0.193670317f +
+                       a2 * (-0.116651117f +
+                             a2 * (0.0528234888f + a2 * -0.0117705003f)))));
+
+  // All ones when |y| > |x|, where the angle is pi / 2 - r
+  uint32_t swap = 0u - (uint32_t)(ay > ax);
+  r = std::bit_cast<float>(std::bit_cast<uint32_t>((float)(M_PI / 2)) & swap) +
+      std::bit_cast<float>(std::bit_cast<uint32_t>(r) ^ (swap & 0x80000000u));
+  // All ones for negative x, where the angle is pi - r
+  uint32_t back = (uint32_t)((int32_t)std::bit_cast<uint32_t>(x) >> 31);
+  r = std::bit_cast<float>(std::bit_cast<uint32_t>((float)M_PI) & back) +
+      std::bit_cast<float>(std::bit_cast<uint32_t>(r) ^ (back & 0x80000000u));
+  return std::copysign(r, y);
+}
+
+// Within 5e-7 radians of acosf. Arguments beyond [-1, 1], which rounding
+// leaves in normalized vectors, clamp to 0 and pi instead of giving NaN
+inline float fast_acos(float x) {
+  float ax = std::fabs(x);
+  // Abramowitz and Stegun 4.4.46, error below 2e-8 before rounding
+  float p =
+      1.5707963050f +
+      ax * (-0.2145988016f +
+            ax * (0.0889789874f +
+                  ax * (-0.0501743046f +
+                        ax * (0.0308918810f +
+                              ax * (-0.0170881256f +
+                                    ax * (0.0066700901f +
+                                          ax * -0.0012624911f))))));
+  float r = std::sqrt(std::max(1.0f - ax, 0.0f)) * p;
+  // All ones for negative x, where the angle is pi - r
+  uint32_t back = (uint32_t)((int32_t)std::bit_cast<uint32_t>(x) >> 31);
+  return std::bit_cast<float>(std::bit_cast<uint32_t>((float)M_PI) & back) +
+         std::bit_cast<float>(std::bit_cast<uint32_t>(r) ^
+                              (back & 0x80000000u));
+}
+} // namespace verdant
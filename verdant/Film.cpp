@@ -1,92 +1,464 @@
 #include "Film.h"
 #include "MathDefs.h"
+#include "Parallel.h"
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
-#include <fstream>
 #include <memory>
+#include <strings.h>
+#include <vector>
+
+namespace {
+template <typename T> void atomic_add(T &target, T value) {
+  std::atomic_ref<T> ref(target);
+  T expected = ref.load(std::memory_order_relaxed);
+  while (!ref.compare_exchange_weak(expected, expected + value,
+                                    std::memory_order_relaxed)) {
+  }
+}
+
+// Enabled output variables as bits, in the order of AovSettings
+uint32_t aov_mask(const verdant::AovSettings &aovs) {
+  return (uint32_t)aovs.albedo | (uint32_t)aovs.normal << 1 |
+         (uint32_t)aovs.depth << 2 | (uint32_t)aovs.primitive_id << 3 |
+         (uint32_t)aovs.lobes << 4;
+}
+} // namespace
 
 namespace verdant {
+void FilmTile::reset(unsigned int x, unsigned int y, unsigned int width,
+                     unsigned int height, const AovSettings &aovs) {
+  this->x = x;
+  this->y = y;
+  this->width = width;
+  this->height = height;
+
+  size_t count = (size_t)width * height;
+  if (count > capacity) {
+    // Cache line aligned, so that no line is shared with another tile
+    void *storage =
+        ::operator new[](count * sizeof(Pixel), std::align_val_t(64));
+    pixels.reset(static_cast<Pixel *>(storage));
+    capacity = count;
+  }
+  for (size_t i = 0; i < count; i++) {
+    new (&pixels[i]) Pixel{float3::ZERO, 0.0f, 0, 0.0};
+  }
+
+  has_aovs = aovs.any();
+  if (has_aovs) {
+    aov_pixels.assign(count, AovSums());
+  }
+}
+
 Film::Film(unsigned int width, unsigned int height)
     : width(width), height(height) {
   s = std::make_unique<float3[]>(width * height);
+  w = std::make_unique<float[]>(width * height);
   n = std::make_unique<unsigned int[]>(width * height);
+  lum_sq = std::make_unique<double[]>(width * height);
   clear();
 }
 
 void Film::clear() {
-  unsigned int x, y;
-  for (y = 0; y < height; y++) {
-    for (x = 0; x < width; x++) {
-      unsigned int i = y * width + x;
+  parallel_for(0, width * height, 0, [this](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
       s[i] = float3::ZERO;
+      w[i] = 0.0f;
       n[i] = 0;
+      lum_sq[i] = 0.0;
     }
+    for (size_t i = begin; aovs.any() && i < end; i++) {
+      if (albedo) {
+        albedo[i] = half3();
+      }
+      if (normal) {
+        normal[i] = half3();
+      }
+      if (depth) {
+        depth[i] = INFINITY;
+      }
+      if (primitive_id) {
+        primitive_id[i] = no_primitive;
+      }
+      for (auto &lobe : lobes) {
+        if (lobe) {
+          lobe[i] = half3();
+        }
+      }
+    }
+  });
+}
+
+void Film::set_aovs(const AovSettings &value) {
+  aovs = value;
+  size_t count = (size_t)width * height;
+  albedo.reset(aovs.albedo ? new half3[count] : nullptr);
+  normal.reset(aovs.normal ? new half3[count] : nullptr);
+  depth.reset(aovs.depth ? new float[count] : nullptr);
+  primitive_id.reset(aovs.primitive_id ? new uint32_t[count] : nullptr);
+  for (auto &lobe : lobes) {
+    lobe.reset(aovs.lobes ? new half3[count] : nullptr);
+  }
+  clear();
+}
+
+std::vector<Film::StateBuffer> Film::get_state_buffers() const {
+  size_t count = (size_t)width * height;
+  std::vector<StateBuffer> buffers;
+  auto add = [&](const auto &buffer) {
+    if (buffer) {
+      buffers.push_back({reinterpret_cast<unsigned char *>(buffer.get()),
+                         count * sizeof(buffer[0])});
+    }
+  };
+  add(s);
+  add(w);
+  add(n);
+  add(lum_sq);
+  add(albedo);
+  add(normal);
+  add(depth);
+  add(primitive_id);
+  for (const auto &lobe : lobes) {
+    add(lobe);
+  }
+  return buffers;
+}
+
+void Film::write_state(std::vector<unsigned char> &bytes) const {
+  // Size and output variables, which read_state must match
+  uint32_t header[3] = {width, height, aov_mask(aovs)};
+  std::vector<StateBuffer> buffers = get_state_buffers();
+  size_t size = sizeof(header);
+  for (const StateBuffer &buffer : buffers) {
+    size += buffer.size;
+  }
+
+  size_t offset = bytes.size();
+  bytes.resize(offset + size);
+  unsigned char *out = bytes.data() + offset;
+  memcpy(out, header, sizeof(header));
+  out += sizeof(header);
+  for (const StateBuffer &buffer : buffers) {
+    memcpy(out, buffer.data, buffer.size);
+    out += buffer.size;
+  }
+}
+
+const unsigned char *Film::read_state(const unsigned char *data,
+                                      const unsigned char *end) {
+  uint32_t header[3];
+  if (end - data < (ptrdiff_t)sizeof(header)) {
+    return nullptr;
+  }
+  memcpy(header, data, sizeof(header));
+  if (header[0] != width || header[1] != height ||
+      header[2] != aov_mask(aovs)) {
+    return nullptr;
   }
+  data += sizeof(header);
+
+  std::vector<StateBuffer> buffers = get_state_buffers();
+  size_t size = 0;
+  for (const StateBuffer &buffer : buffers) {
+    size += buffer.size;
+  }
+  if ((size_t)(end - data) < size) {
+    return nullptr;
+  }
+  for (const StateBuffer &buffer : buffers) {
+    memcpy(buffer.data, data, buffer.size);
+    data += buffer.size;
+  }
+  return data;
+}
+
+float3 Film::get_albedo(unsigned int x, unsigned int y) const {
+  return albedo[y * width + x].to_float3();
+}
+
+float3 Film::get_normal(unsigned int x, unsigned int y) const {
+  return normal[y * width + x].to_float3();
+}
+
+float Film::get_depth(unsigned int x, unsigned int y) const {
+  return depth[y * width + x];
+}
+
+uint32_t Film::get_primitive_id(unsigned int x, unsigned int y) const {
+  return primitive_id[y * width + x];
+}
+
+float3 Film::get_lobe_radiance(unsigned int x, unsigned int y,
+                               Lobe lobe) const {
+  return lobes[(int)lobe][y * width + x].to_float3();
 }
 
 float3 Film::get_radiance(unsigned int x, unsigned int y) const {
+  return get_radiance(y * width + x);
+}
+
+void Film::set_radiance(unsigned int x, unsigned int y, float3 value) {
+  unsigned int i = y * width + x;
+  float l = luminance(value);
+  s[i] = value;
+  w[i] = 1.0f;
+  n[i] = 1;
+  lum_sq[i] = (double)l * l;
+}
+
+void Film::average_radiance(unsigned int x, unsigned int y, float3 Li,
+                            float weight) {
   unsigned int i = y * width + x;
-  return s[i];
+  float l = luminance(Li);
+  s[i] += Li * weight;
+  w[i] += weight;
+  n[i] += 1;
+  lum_sq[i] += (double)l * l;
 }
 
-void Film::average_radiance(unsigned int x, unsigned int y, float3 Li) {
+void Film::average_radiance_atomic(unsigned int x, unsigned int y,
+                                   float3 Li, float weight) {
   unsigned int i = y * width + x;
-  // WARNING: thread unsafe
-  float3 prev_avg = s[i];
-  unsigned int ni = n[i];
-  s[i] = (prev_avg * ni + Li) / (ni + 1);
-  n[i] = ni + 1;
+  float l = luminance(Li);
+  for (int c = 0; c < 3; c++) {
+    atomic_add(s[i][c], Li[c] * weight);
+  }
+  atomic_add(w[i], weight);
+  std::atomic_ref<unsigned int>(n[i]).fetch_add(1, std::memory_order_relaxed);
+  atomic_add(lum_sq[i], (double)l * l);
 }
 
 void Film::accumulate_radiance(unsigned int x, unsigned int y, float3 Li) {
   unsigned int i = y * width + x;
-  // WARNING: thread unsafe
-  s[i] = s[i] + Li;
+  for (int c = 0; c < 3; c++) {
+    atomic_add(s[i][c], Li[c]);
+  }
+}
+
+void Film::merge_tile(const FilmTile &tile) {
+  unsigned int x_end = std::min(tile.x + tile.width, width);
+  unsigned int y_end = std::min(tile.y + tile.height, height);
+  for (unsigned int y = tile.y; y < y_end; y++) {
+    const FilmTile::Pixel *p = &tile.pixels[(y - tile.y) * tile.width];
+    unsigned int i = y * width + tile.x;
+    for (unsigned int x = tile.x; x < x_end; x++, i++, p++) {
+      if (p->n == 0) {
+        continue;
+      }
+      if (tile.has_aovs) {
+        merge_aovs(i, n[i], tile.aov_pixels[p - tile.pixels.get()], p->n);
+      }
+      s[i] += p->sum;
+      w[i] += p->weight;
+      n[i] += p->n;
+      lum_sq[i] += p->lum_sq;
+    }
+  }
+}
+
+void Film::merge_aovs(unsigned int i, unsigned int film_n,
+                      const AovSums &p, unsigned int tile_n) {
+  // Means are kept in half precision, so fold the sums of the tile into them
+  float scale = 1.0f / (film_n + tile_n);
+  auto merge_mean = [&](half3 &mean, const float3 &sum) {
+    mean = half3((mean.to_float3() * (float)film_n + sum) * scale);
+  };
+  if (albedo) {
+    merge_mean(albedo[i], p.albedo);
+  }
+  if (normal) {
+    merge_mean(normal[i], p.normal);
+  }
+  if (depth) {
+    depth[i] = std::min(depth[i], p.depth);
+  }
+  if (primitive_id && primitive_id[i] == no_primitive) {
+    primitive_id[i] = p.primitive_id;
+  }
+  for (int k = 0; k < lobe_count; k++) {
+    if (lobes[k]) {
+      merge_mean(lobes[k][i], p.lobes[k]);
+    }
+  }
+}
+
+unsigned int Film::get_sample_count(unsigned int x, unsigned int y) const {
+  return n[y * width + x];
+}
+
+unsigned long long Film::get_total_sample_count() const {
+  return parallel_reduce(
+      0, width * height, 0, 0ull,
+      [this](size_t begin, size_t end, unsigned long long total) {
+        for (size_t i = begin; i < end; i++) {
+          total += n[i];
+        }
+        return total;
+      },
+      [](unsigned long long a, unsigned long long b) { return a + b; });
+}
+
+unsigned int Film::get_min_sample_count() const {
+  return parallel_reduce(
+      0, width * height, 0, UINT_MAX,
+      [this](size_t begin, size_t end, unsigned int least) {
+        for (size_t i = begin; i < end; i++) {
+          least = std::min(least, n[i]);
+        }
+        return least;
+      },
+      [](unsigned int a, unsigned int b) { return std::min(a, b); });
+}
+
+float Film::get_variance(unsigned int x, unsigned int y) const {
+  unsigned int i = y * width + x;
+  if (n[i] < 2) {
+    return 0.0f;
+  }
+  // Around the weighted mean, which is the plain mean unless filter weights
+  // vary. Rounding may leave the difference slightly negative
+  double mean = luminance(get_radiance(i));
+  double m2 = std::max(lum_sq[i] - mean * mean * n[i], 0.0);
+  return (float)(m2 / (n[i] - 1));
+}
+
+float Film::get_relative_error(unsigned int x, unsigned int y) const {
+  unsigned int i = y * width + x;
+  if (n[i] < 2) {
+    return INFINITY;
+  }
+  float standard_error = sqrtf(get_variance(x, y) / n[i]);
+  // Offset the mean so that nearly black pixels do not demand endless samples
+  return standard_error / (luminance(get_radiance(i)) + 0.01f);
 }
 
 float2 Film::xy_to_uv(unsigned int x, unsigned int y) const {
   return {(float)x / width, (float)y / height};
 }
 
+float2 Film::xy_to_uv(float2 position) const {
+  return {position.x() / width, position.y() / height};
+}
+
+void Film::write(const std::string &file_name) const {
+  auto has_extension = [&file_name](const std::string &extension) {
+    return file_name.size() >= extension.size() &&
+           strcasecmp(file_name.c_str() + file_name.size() - extension.size(),
+                      extension.c_str()) == 0;
+  };
+  if (has_extension(".pfm")) {
+    write_to_pfm(file_name);
+  } else if (has_extension(".exr")) {
+    write_to_exr(file_name);
+  } else {
+    write_to_ppm(file_name);
+  }
+}
+
 void Film::write_to_ppm(const std::string &file_name) const {
-  std::ofstream ofs(file_name);
-  if (!ofs.is_open()) {
+  TraceScope scope("film write");
+  std::vector<unsigned char> rgb((size_t)width * height * 3);
+  map_rows(rgb.data(), PixelLayout::RGB);
+  if (!ImageWriter::write_ppm(file_name, width, height, rgb.data())) {
     fprintf(stderr, "Could not open file %s to write\n", file_name.c_str());
-    return;
   }
+}
 
-  ofs << "P3" << std::endl;
-  ofs << width << " " << height << std::endl;
-  ofs << "255" << std::endl;
+void Film::write_to_pfm(const std::string &file_name) const {
+  TraceScope scope("film write");
+  std::vector<float> rgb((size_t)width * height * 3);
+  write_to_rgb_float(rgb.data());
+  if (!ImageWriter::write_pfm(file_name, width, height, rgb.data())) {
+    fprintf(stderr, "Could not open file %s to write\n", file_name.c_str());
+  }
+}
 
-  unsigned int x, y;
-  for (y = 0; y < height; y++) {
-    for (x = 0; x < width; x++) {
-      if (x != 0) {
-        ofs << " ";
+void Film::write_to_exr(const std::string &file_name,
+                        ExrCompression compression) const {
+  TraceScope scope("film write");
+  std::vector<float> rgb((size_t)width * height * 3);
+  write_to_rgb_float(rgb.data());
+  std::vector<ImageChannel> channels = {{"R", &rgb[0], 3},
+                                        {"G", &rgb[1], 3},
+                                        {"B", &rgb[2], 3}};
+
+  // Output variables in float, with the channel names compositors expect
+  size_t count = (size_t)width * height;
+  std::vector<std::vector<float>> planes;
+  auto add_half3 = [&](const half3 *values, const char *layer,
+                       const char *names) {
+    std::vector<float> &plane = planes.emplace_back(count * 3);
+    parallel_for(0, count, 0, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        float3 v = values[i].to_float3();
+        plane[i * 3 + 0] = v.x();
+        plane[i * 3 + 1] = v.y();
+        plane[i * 3 + 2] = v.z();
       }
-      unsigned int i = y * width + x;
-      uint3 colors = clamp_to_255(reinhard_tone_mapping(s[i]));
-      ofs << colors[0] << " ";
-      ofs << colors[1] << " ";
-      ofs << colors[2];
+    });
+    for (int c = 0; c < 3; c++) {
+      channels.push_back(
+          {std::string(layer) + "." + names[c], &plane[c], 3});
     }
-    ofs << std::endl;
+  };
+  if (albedo) {
+    add_half3(albedo.get(), "albedo", "RGB");
+  }
+  if (normal) {
+    add_half3(normal.get(), "N", "XYZ");
+  }
+  if (depth) {
+    channels.push_back({"Z", depth.get(), 1});
+  }
+  if (primitive_id) {
+    // Exact up to 2^24 primitives, with -1 where nothing was hit
+    std::vector<float> &plane = planes.emplace_back(count);
+    for (size_t i = 0; i < count; i++) {
+      plane[i] = primitive_id[i] == no_primitive ? -1.0f : primitive_id[i];
+    }
+    channels.push_back({"id", plane.data(), 1});
+  }
+  const char *lobe_names[lobe_count] = {"emission", "diffuse", "specular"};
+  for (int k = 0; k < lobe_count; k++) {
+    if (lobes[k]) {
+      add_half3(lobes[k].get(), lobe_names[k], "RGB");
+    }
+  }
+  if (!ImageWriter::write_exr(file_name, width, height, channels,
+                              compression)) {
+    fprintf(stderr, "Could not open file %s to write\n", file_name.c_str());
   }
 }
 
-void Film::write_to_rgb32(unsigned char *buffer) const {
-  unsigned int x, y;
-  for (y = 0; y < height; y++) {
-    for (x = 0; x < width; x++) {
-      unsigned int i = y * width + x;
-      uint3 colors = clamp_to_255(reinhard_tone_mapping(s[i]));
-      // BGRA from low byte to high byte
-      *buffer++ = colors[2];
-      *buffer++ = colors[1];
-      *buffer++ = colors[0];
-      *buffer++ = 255;
+void Film::write_to_rgb_float(float *buffer) const {
+  parallel_for(0, width * height, 0, [this, buffer](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      float3 radiance = get_radiance(i);
+      buffer[i * 3 + 0] = radiance.x();
+      buffer[i * 3 + 1] = radiance.y();
+      buffer[i * 3 + 2] = radiance.z();
     }
-  }
+  });
+}
+
+void Film::write_to_rgb32(unsigned char *buffer) const {
+  map_rows(buffer, PixelLayout::BGRA);
+}
+
+void Film::map_rows(unsigned char *buffer, PixelLayout layout) const {
+  static_assert(sizeof(float3) == 3 * sizeof(float), "float3 is packed");
+  const float *sums = reinterpret_cast<const float *>(s.get());
+  size_t pixel_size = layout == PixelLayout::RGB ? 3 : 4;
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    size_t i = begin * width;
+    tone_mapper.map(sums + i * 3, w.get() + i, n.get() + i,
+                    (end - begin) * width, buffer + i * pixel_size, layout);
+  });
 }
 } // namespace verdant
@@ -1,8 +1,21 @@
 #pragma once
+#include "Aov.h"
+#include "Filter.h"
+#include "Half.h"
+#include "ImageWriter.h"
 #include "MathDefs.h"
+#include "ToneMapper.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
+#include <string>
+#include <vector>
 
 namespace verdant {
+class FilmTile;
+
 // AKA framebuffer
 class Film {
 public:
@@ -14,26 +27,134 @@ public:
 
   void clear();
 
+  // Filter that camera samples are distributed and weighted by, a box over
+  // the pixel by default
+  const Filter &get_filter() const { return filter; }
+  void set_filter(const Filter &value) { filter = value; }
+
+  // Conversion to 8 bit of write_to_ppm and write_to_rgb32, Reinhard without
+  // sRGB encoding by default
+  const ToneMapper &get_tone_mapper() const { return tone_mapper; }
+  void set_tone_mapper(const ToneMapper &value) { tone_mapper = value; }
+
+  // Enables and disables output variables, clearing them. Disabled ones use
+  // no memory
+  const AovSettings &get_aovs() const { return aovs; }
+  void set_aovs(const AovSettings &value);
+
+  // Means over the samples of a pixel, see AovSettings. Only valid when
+  // enabled, and only filled by samples merged with merge_tile
+  float3 get_albedo(unsigned int x, unsigned int y) const;
+  float3 get_normal(unsigned int x, unsigned int y) const;
+  float get_depth(unsigned int x, unsigned int y) const;
+  uint32_t get_primitive_id(unsigned int x, unsigned int y) const;
+  float3 get_lobe_radiance(unsigned int x, unsigned int y, Lobe lobe) const;
+
+  // Weighted mean of the samples of a pixel
   float3 get_radiance(unsigned int x, unsigned int y) const;
-  void average_radiance(unsigned int x, unsigned int y, float3 Li);
+
+  // Replaces the samples of a pixel with a single one of the given radiance,
+  // e.g. for a filtered copy of another film
+  void set_radiance(unsigned int x, unsigned int y, float3 value);
+
+  // Adds a sample with a filter weight to a pixel. The caller must be the
+  // only thread writing the pixel, such as the one rendering its tile
+  void average_radiance(unsigned int x, unsigned int y, float3 Li,
+                        float weight = 1.0f);
+
+  // Same as average_radiance, but safe to call concurrently for the same
+  // pixel, e.g. for overlapping tiles or filter footprints crossing tiles
+  void average_radiance_atomic(unsigned int x, unsigned int y, float3 Li,
+                               float weight = 1.0f);
+
+  /**
+   * @brief Adds radiance to a pixel without counting a sample, so it is
+   * divided by the weights of the pixel like its other samples. Safe to
+   * call concurrently, e.g. for splats of light or bidirectional paths
+   *
+   * @param Li Radiance, already weighted by the caller
+   */
   void accumulate_radiance(unsigned int x, unsigned int y, float3 Li);
 
+  // Adds the samples of a tile to the film. Tiles that do not overlap may be
+  // merged concurrently
+  void merge_tile(const FilmTile &tile);
+
+  // Number of samples averaged into a pixel
+  unsigned int get_sample_count(unsigned int x, unsigned int y) const;
+  unsigned long long get_total_sample_count() const;
+  unsigned int get_min_sample_count() const;
+
+  // Sample variance of the luminance of the samples averaged into a pixel
+  float get_variance(unsigned int x, unsigned int y) const;
+
+  /**
+   * @brief Estimates the error of a pixel as the standard error of its mean
+   * luminance, relative to that mean. Used to decide when a pixel converged
+   *
+   * @return float Relative error, infinite with fewer than two samples
+   */
+  float get_relative_error(unsigned int x, unsigned int y) const;
+
+  /**
+   * @brief Appends the raw state of the film to bytes, in host byte order:
+   * the sums, weights and sample counts of every pixel and the enabled
+   * output variables. Samples added to the film after read_state of it
+   * continue where the saved film stopped
+   *
+   * @param bytes Buffer to append to
+   */
+  void write_state(std::vector<unsigned char> &bytes) const;
+
+  /**
+   * @brief Restores state appended by write_state of a film with the same
+   * size and output variables. The film is unchanged if it does not match
+   *
+   * @param data Start of the state
+   * @param end End of the buffer holding it
+   * @return const unsigned char* End of the state, or null if it does not
+   * match or the buffer is too short
+   */
+  const unsigned char *read_state(const unsigned char *data,
+                                  const unsigned char *end);
+
   float2 xy_to_uv(unsigned int x, unsigned int y) const;
+  // Continuous position on the film, pixel x covers [x, x + 1)
+  float2 xy_to_uv(float2 position) const;
 
   /**
-   * @brief Gets a raw array of R32G32B32 format, with row pitch 12 * width
+   * @brief Gets a raw array of R32G32B32 format, with row pitch 12 * width.
+   * These are the weighted sums of the samples, use get_radiance for means
    *
    * @return const void* Pointer to the data
    */
   const void *data() const { return s.get(); }
 
   /**
-   * @brief Write the film data into a new RGB ppm file
+   * @brief Writes the film in the format given by the extension of the file
+   * name: .pfm, .exr, or else ppm
+   *
+   * @param file_name Full name or path to the file
+   */
+  void write(const std::string &file_name) const;
+
+  /**
+   * @brief Write the film data into a new binary RGB ppm file, tone mapped
    *
    * @param file_name Full name or path to the file
    */
   void write_to_ppm(const std::string &file_name) const;
 
+  // Linear radiance as float RGB, for compositing. EXR files also get the
+  // enabled output variables as extra channels
+  void write_to_pfm(const std::string &file_name) const;
+  void write_to_exr(const std::string &file_name,
+                    ExrCompression compression = ExrCompression::Rle) const;
+
+  // Linear radiance as R32G32B32, rows from top to bottom
+  void write_to_rgb_float(float *buffer) const;
+
+  // Tone mapped BGRA, 4 bytes per pixel from low to high address
   void write_to_rgb32(unsigned char *buffer) const;
 
   /**
@@ -84,11 +205,115 @@ public:
 
   static float3 reinhard_tone_mapping(float3 in) { return in / (in + 1); }
 
+  static float luminance(float3 c) {
+    return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+  }
+
 private:
-  // Backing storage: r32 g32 b32
+  // Folds the output variables of a tile pixel into pixel i, which had
+  // film_n samples before the tile_n samples of the tile
+  void merge_aovs(unsigned int i, unsigned int film_n,
+                  const AovSums &p, unsigned int tile_n);
+
+  struct StateBuffer {
+    unsigned char *data;
+    size_t size;
+  };
+  // Buffers written and read by write_state and read_state, in order
+  std::vector<StateBuffer> get_state_buffers() const;
+
+  // Tone maps all rows in parallel
+  void map_rows(unsigned char *buffer, PixelLayout layout) const;
+
+  float3 get_radiance(unsigned int i) const {
+    // Pixels without samples or with cancelled weights are black
+    return is_weight_usable(w[i], n[i]) ? s[i] / w[i] : float3::ZERO;
+  }
+
+  Filter filter;
+  ToneMapper tone_mapper;
+  // Backing storage: weighted sums of r32 g32 b32. Sums rather than running
+  // averages let concurrent writers add with atomics and without division
   std::unique_ptr<float3[]> s;
+  // Sums of the filter weights
+  std::unique_ptr<float[]> w;
   std::unique_ptr<unsigned int[]> n;
+  // Sum of the squared luminance of the samples, for their variance. Double,
+  // as the variance is its small difference from the squared sum
+  std::unique_ptr<double[]> lum_sq;
+
+  AovSettings aovs;
+  std::unique_ptr<half3[]> albedo;
+  std::unique_ptr<half3[]> normal;
+  std::unique_ptr<float[]> depth;
+  std::unique_ptr<uint32_t[]> primitive_id;
+  std::unique_ptr<half3[]> lobes[lobe_count];
+
   unsigned int width;
   unsigned int height;
 };
+
+/**
+ * @brief Private accumulation buffer for one tile of a film. A thread renders
+ * a tile into it and merges it into the film once, so the shared film is not
+ * written per sample and neighbouring tiles do not share cache lines
+ *
+ * Reusing a tile for later tiles reuses its storage.
+ *
+ */
+class FilmTile {
+public:
+  // Starts accumulating the rectangle at x, y, in film coordinates. Output
+  // variables are accumulated if any are enabled in aovs
+  void reset(unsigned int x, unsigned int y, unsigned int width,
+             unsigned int height, const AovSettings &aovs = {});
+
+  unsigned int get_x() const { return x; }
+  unsigned int get_y() const { return y; }
+  unsigned int get_width() const { return width; }
+  unsigned int get_height() const { return height; }
+
+  // Adds a sample to a pixel, x and y in film coordinates. aov may be null
+  // or ignored when the tile has no output variables
+  void add_sample(unsigned int x, unsigned int y, float3 Li,
+                  float weight = 1.0f, const AovSample *aov = nullptr) {
+    size_t i = (y - this->y) * width + (x - this->x);
+    Pixel &p = pixels[i];
+    float l = Film::luminance(Li);
+    p.sum += Li * weight;
+    p.weight += weight;
+    p.n += 1;
+    p.lum_sq += (double)l * l;
+    if (aov && has_aovs) {
+      aov_pixels[i].add(*aov);
+    }
+  }
+
+private:
+  friend class Film;
+
+  // Same sums as the film, kept together per pixel
+  struct Pixel {
+    float3 sum;
+    float weight;
+    unsigned int n;
+    double lum_sq;
+  };
+
+  struct AlignedDelete {
+    void operator()(Pixel *p) const {
+      ::operator delete[](p, std::align_val_t(64));
+    }
+  };
+
+  std::unique_ptr<Pixel[], AlignedDelete> pixels;
+  size_t capacity = 0;
+  // Apart from pixels, which stay small when output variables are off
+  std::vector<AovSums> aov_pixels;
+  bool has_aovs = false;
+  unsigned int x = 0;
+  unsigned int y = 0;
+  unsigned int width = 0;
+  unsigned int height = 0;
+};
 } // namespace verdant
@@ -0,0 +1,92 @@
+#include "Filter.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// Mitchell-Netravali with B = C = 1/3, for x in [0, 2]
+float mitchell_1d(float x) {
+  const float B = 1.0f / 3.0f;
+  const float C = 1.0f / 3.0f;
+  x = fabsf(x);
+  if (x < 1.0f) {
+    return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x +
+            (6 - 2 * B)) /
+           6;
+  } else if (x < 2.0f) {
+    return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x +
+            (-12 * B - 48 * C) * x + (8 * B + 24 * C)) /
+           6;
+  }
+  return 0.0f;
+}
+} // namespace
+
+namespace verdant {
+Filter::Filter(FilterKind kind, float radius) : kind(kind), radius(radius) {
+  if (this->radius <= 0.0f) {
+    switch (kind) {
+    case FilterKind::Box:
+      this->radius = 0.5f;
+      break;
+    case FilterKind::Tent:
+      this->radius = 1.0f;
+      break;
+    case FilterKind::Gaussian:
+      this->radius = 1.5f;
+      break;
+    case FilterKind::Mitchell:
+      this->radius = 2.0f;
+      break;
+    }
+  }
+
+  float bin_width = 2 * this->radius / table_size;
+  cdf[0] = 0.0f;
+  for (int i = 0; i < table_size; i++) {
+    table[i] = evaluate_1d(-this->radius + (i + 0.5f) * bin_width);
+    cdf[i + 1] = cdf[i] + fabsf(table[i]) * bin_width;
+  }
+  integral = cdf[table_size];
+  for (float &c : cdf) {
+    c /= integral;
+  }
+}
+
+float Filter::evaluate_1d(float x) const {
+  if (fabsf(x) > radius) {
+    return 0.0f;
+  }
+  switch (kind) {
+  case FilterKind::Box:
+    return 1.0f;
+  case FilterKind::Tent:
+    return radius - fabsf(x);
+  case FilterKind::Gaussian: {
+    // Standard deviation of 0.5 pixels, shifted to reach 0 at the radius
+    const float sigma = 0.5f;
+    float g = expf(-x * x / (2 * sigma * sigma));
+    float g_radius = expf(-radius * radius / (2 * sigma * sigma));
+    return std::max(g - g_radius, 0.0f);
+  }
+  case FilterKind::Mitchell:
+    // Stretched from its natural support of 2 to the radius
+    return mitchell_1d(2 * x / radius);
+  }
+  return 0.0f;
+}
+
+std::tuple<float, float> Filter::sample_1d(float u) const {
+  // Last entry of cdf not greater than u
+  int bin = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+  bin = std::clamp(bin, 0, table_size - 1);
+  float bin_cdf = cdf[bin + 1] - cdf[bin];
+  float t = bin_cdf > 0.0f ? (u - cdf[bin]) / bin_cdf : 0.5f;
+
+  float bin_width = 2 * radius / table_size;
+  float x = -radius + (bin + t) * bin_width;
+  // The pdf is |table[bin]| / integral, so the filter over the pdf is the
+  // integral, with the sign of the lobe
+  float weight = table[bin] < 0.0f ? -integral : integral;
+  return {x, weight};
+}
+} // namespace verdant
@@ -0,0 +1,70 @@
+#pragma once
+#include "MathDefs.h"
+#include <array>
+#include <cmath>
+#include <tuple>
+
+namespace verdant {
+enum class FilterKind { Box, Tent, Gaussian, Mitchell };
+
+/**
+ * @brief Pixel reconstruction filter. Rather than splatting every sample into
+ * the pixels under its footprint, sample positions are drawn around the pixel
+ * center in proportion to the filter, as in pbrt-v4. Each sample then only
+ * lands in its own pixel, weighted by the filter over its pdf
+ *
+ * All filters are separable. The 1D profile is tabulated once at
+ * construction, and sampled by inverting the table's CDF.
+ *
+ */
+class Filter {
+public:
+  /**
+   * @brief Creates a filter of the given kind
+   *
+   * @param kind Filter profile
+   * @param radius Support in pixels along each axis, or 0 for the default of
+   * the kind: 0.5 for box, 1 for tent, 1.5 for Gaussian and 2 for Mitchell
+   */
+  explicit Filter(FilterKind kind = FilterKind::Box, float radius = 0.0f);
+
+  FilterKind get_kind() const { return kind; }
+  float get_radius() const { return radius; }
+
+  // Value of the filter at an offset from the pixel center
+  float evaluate(float2 offset) const {
+    return evaluate_1d(offset.x()) * evaluate_1d(offset.y());
+  }
+
+  // Maps two uniform numbers to an offset from the pixel center and the
+  // weight of a sample taken there. Weights are negative in the negative
+  // lobes of Mitchell, and constant for the other filters
+  std::tuple<float2, float> sample(float u0, float u1) const {
+    auto [x, weight_x] = sample_1d(u0);
+    auto [y, weight_y] = sample_1d(u1);
+    return {{x, y}, weight_x * weight_y};
+  }
+
+private:
+  float evaluate_1d(float x) const;
+  std::tuple<float, float> sample_1d(float u) const;
+
+  static constexpr int table_size = 64;
+
+  FilterKind kind;
+  float radius;
+  // Filter at the centers of table_size bins covering [-radius, radius]
+  std::array<float, table_size> table;
+  // Normalized running sums of the absolute table, cdf[0] = 0
+  std::array<float, table_size + 1> cdf;
+  // Integral of the absolute filter over [-radius, radius]
+  float integral;
+};
+
+// Whether the weight sum of count samples is far enough from 0 to divide by.
+// Negative lobes can cancel the weights of a pixel, and dividing by what is
+// left would blow up its noise
+inline bool is_weight_usable(float weight_sum, unsigned int count) {
+  return std::fabs(weight_sum) > 1e-3f * count;
+}
+} // namespace verdant
@@ -1,14 +1,23 @@
 // HDR run-length encoding should not be rewritten on our own
-// We take from the official implementation at ray/src/common/color.c
+// We follow the official implementation at ray/src/common/color.c, decoding
+// from memory instead of through getc
 
 #include "HDRImage.h"
+#include "Half.h"
 #include "MathDefs.h"
+#include "Parallel.h"
+#include "Rgb9e5.h"
+#include "Trace.h"
+#include <algorithm>
+#include <bit>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
-
-#define BUF_LEN 256
+#include <new>
+#include <vector>
 
 #define MINELEN 8
 #define MAXELEN 0x7fff
@@ -19,162 +28,374 @@
 #define EXP 3
 #define COLXS 128
 
-#define copycolr(c1, c2)                                                       \
-  (c1[0] = c2[0], c1[1] = c2[1], c1[2] = c2[2], c1[3] = c2[3])
-
-typedef unsigned char COLR[4];
-
 namespace {
-int fgetline(char *buf, size_t buf_len, FILE *f) {
-  int i = 0;
-  while (i < BUF_LEN) {
-    int ch = fgetc(f);
-    if (ch == '\n') {
-      buf[i++] = 0;
-      break;
-    } else {
-      buf[i++] = ch;
+// Reads a whole file with one call
+bool read_file(const std::string &file_name,
+               std::vector<unsigned char> &bytes) {
+  FILE *f = fopen(file_name.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  bool read = false;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    long size = ftell(f);
+    if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+      bytes.resize(size);
+      read = fread(bytes.data(), 1, size, f) == (size_t)size;
     }
   }
-  return i - 1;
+  fclose(f);
+  return read;
 }
 
-int oldreadcolrs(COLR *scanline, int len, FILE *fp) {
+// Returns the line at p without its newline and moves p past it, or returns
+// false at the end of the data
+bool next_line(const unsigned char *&p, const unsigned char *end,
+               std::string &line) {
+  const unsigned char *newline =
+      static_cast<const unsigned char *>(memchr(p, '\n', end - p));
+  if (!newline) {
+    return false;
+  }
+  line.assign(reinterpret_cast<const char *>(p), newline - p);
+  p = newline + 1;
+  return true;
+}
+
+/**
+ * @brief Decodes a scanline in the flat format, where runs are pixels of
+ * 1, 1, 1, count. Consecutive runs shift their counts by 8 bits more
+ *
+ * @param planes Red, green, blue and exponent planes of len bytes each, or
+ * null to only find the end of the scanline
+ * @return const unsigned char* End of the scanline, or null if it is corrupt
+ */
+const unsigned char *old_read_colrs(const unsigned char *p,
+                                    const unsigned char *end, int len,
+                                    unsigned char *planes) {
   int rshift = 0;
-  int i;
-
-  while (len > 0) {
-    scanline[0][RED] = getc(fp);
-    scanline[0][GRN] = getc(fp);
-    scanline[0][BLU] = getc(fp);
-    scanline[0][EXP] = i = getc(fp);
-    if (i == EOF)
-      return (-1);
-    if (scanline[0][GRN] == 1 &&
-        (scanline[0][RED] == 1) & (scanline[0][BLU] == 1)) {
-      i = scanline[0][EXP] << rshift;
-      while (i--) {
-        copycolr(scanline[0], scanline[-1]);
-        if (--len <= 0)
-          return (0);
-        scanline++;
+  int j = 0;
+  while (j < len) {
+    if (end - p < 4) {
+      return nullptr;
+    }
+    if (p[RED] == 1 && p[GRN] == 1 && p[BLU] == 1) {
+      // Repeats the previous pixel, which must be in this scanline so that
+      // scanlines decode independently
+      if (j == 0) {
+        return nullptr;
+      }
+      int count = std::min(p[EXP] << rshift, len - j);
+      if (planes) {
+        for (int c = 0; c < 4; c++) {
+          unsigned char *plane = planes + c * len;
+          memset(plane + j, plane[j - 1], count);
+        }
       }
+      j += count;
       rshift += 8;
     } else {
-      scanline++;
-      len--;
+      if (planes) {
+        for (int c = 0; c < 4; c++) {
+          planes[c * len + j] = p[c];
+        }
+      }
+      j++;
       rshift = 0;
     }
+    p += 4;
   }
-  return (0);
+  return p;
 }
 
-int freadcolrs(COLR *scanline, int len, FILE *fp) {
-  int i, j;
-  int code, val;
-  /* determine scanline type */
-  if ((len < MINELEN) | (len > MAXELEN))
-    return (oldreadcolrs(scanline, len, fp));
-  if ((i = getc(fp)) == EOF)
-    return (-1);
-  if (i != 2) {
-    ungetc(i, fp);
-    return (oldreadcolrs(scanline, len, fp));
-  }
-  scanline[0][GRN] = getc(fp);
-  scanline[0][BLU] = getc(fp);
-  if ((i = getc(fp)) == EOF)
-    return (-1);
-  if ((scanline[0][GRN] != 2) | ((scanline[0][BLU] & 0x80) != 0)) {
-    scanline[0][RED] = 2;
-    scanline[0][EXP] = i;
-    return (oldreadcolrs(scanline + 1, len - 1, fp));
-  }
-  if ((scanline[0][BLU] << 8 | i) != len)
-    return (-1); /* length mismatch! */
-                 /* read each component */
-  for (i = 0; i < 4; i++)
-    for (j = 0; j < len;) {
-      if ((code = getc(fp)) == EOF)
-        return (-1);
+// Decodes a scanline in either format, see old_read_colrs. New scanlines
+// store each component as its own runs and literals
+const unsigned char *read_colrs(const unsigned char *p,
+                                const unsigned char *end, int len,
+                                unsigned char *planes) {
+  if (len < MINELEN || len > MAXELEN || end - p < 4 || p[0] != 2 ||
+      p[1] != 2 || (p[2] & 0x80) != 0) {
+    return old_read_colrs(p, end, len, planes);
+  }
+  if ((p[2] << 8 | p[3]) != len) {
+    return nullptr; /* length mismatch! */
+  }
+  p += 4;
+  for (int c = 0; c < 4; c++) {
+    unsigned char *plane = planes ? planes + c * len : nullptr;
+    for (int j = 0; j < len;) {
+      if (p == end) {
+        return nullptr;
+      }
+      int code = *p++;
       if (code > 128) { /* run */
         code &= 127;
-        if ((val = getc(fp)) == EOF)
-          return -1;
-        if (j + code > len)
-          return -1; /* overrun */
-        while (code--)
-          scanline[j++][i] = val;
+        if (p == end || j + code > len) {
+          return nullptr; /* overrun */
+        }
+        if (plane) {
+          memset(plane + j, *p, code);
+        }
+        p++;
       } else { /* non-run */
-        if (j + code > len)
-          return -1; /* overrun */
-        while (code--) {
-          if ((val = getc(fp)) == EOF)
-            return -1;
-          scanline[j++][i] = val;
+        if (end - p < code || j + code > len) {
+          return nullptr; /* overrun */
         }
+        if (plane) {
+          memcpy(plane + j, p, code);
+        }
+        p += code;
       }
+      j += code;
     }
-  return (0);
+  }
+  return p;
 }
 
-verdant::float3 colr_to_float3(COLR clr) {
-  verdant::float3 col;
-  double f;
-
-  if (clr[EXP] == 0)
-    col[RED] = col[GRN] = col[BLU] = 0.0;
-  else {
-    f = ldexp(1.0, (int)clr[EXP] - (COLXS + 8));
-    col[RED] = (clr[RED] + 0.5) * f;
-    col[GRN] = (clr[GRN] + 0.5) * f;
-    col[BLU] = (clr[BLU] + 0.5) * f;
+/**
+ * @brief Converts a scanline of RGBE planes to float RGB. The scale
+ * 2^(exponent - COLXS - 8) is built directly in the exponent bits of a float
+ * instead of calling ldexp, so the loop vectorizes. Exponents that would
+ * give subnormal scales become 0, which the format uses for black anyway
+ *
+ * @param planes Red, green, blue and exponent planes of len bytes each
+ * @param rgb Output of len pixels, constructed in place
+ */
+void colrs_to_floats(const unsigned char *planes, int len,
+                     verdant::float3 *rgb) {
+  // Blocks go through local arrays. Stores to rgb could otherwise alias the
+  // bytes of the planes, and the compiler would not vectorize
+  const int block_size = 64;
+  alignas(64) float values[3][block_size];
+  for (int start = 0; start < len; start += block_size) {
+    int n = std::min(block_size, len - start);
+    const unsigned char *r = planes + start;
+    const unsigned char *g = r + len;
+    const unsigned char *b = g + len;
+    const unsigned char *e = b + len;
+    for (int i = 0; i < n; i++) {
+      int32_t biased = (int32_t)e[i] - (COLXS + 8) + 127;
+      biased = biased > 0 ? biased : 0;
+      float f = std::bit_cast<float>(biased << 23);
+      values[RED][i] = (r[i] + 0.5f) * f;
+      values[GRN][i] = (g[i] + 0.5f) * f;
+      values[BLU][i] = (b[i] + 0.5f) * f;
+    }
+    for (int i = 0; i < n; i++) {
+      new (&rgb[start + i])
+          verdant::float3(values[RED][i], values[GRN][i], values[BLU][i]);
+    }
   }
-  return col;
 }
 } // namespace
 
 namespace verdant {
-HDRImage::HDRImage(const std::string &file_name) : valid(false) {
-  char buf[BUF_LEN];
-  FILE *f = fopen(file_name.c_str(), "rb");
-  if (!f) {
+HDRImage::HDRImage(const std::string &file_name, TexelFormat format)
+    : valid(false), format(format) {
+  TraceScope scope("HDR load");
+  std::vector<unsigned char> bytes;
+  if (!read_file(file_name, bytes)) {
     return;
   }
+  const unsigned char *p = bytes.data();
+  const unsigned char *end = p + bytes.size();
 
-  // Check signature
-  fread(buf, 11, 1, f);
-  if (memcmp(buf, "#?RADIANCE\n", 10)) {
-    fclose(f);
+  // Check signature, and skip the header up to its empty line
+  std::string line;
+  if (!next_line(p, end, line) ||
+      (line != "#?RADIANCE" && line != "#?RGBE")) {
     return;
   }
-
-  int line_len;
   do {
-    line_len = fgetline(buf, BUF_LEN, f);
-  } while (line_len > 0);
-
-  line_len = fgetline(buf, BUF_LEN, f);
-  sscanf(buf, "-Y %d +X %d", &height, &width);
+    if (!next_line(p, end, line)) {
+      return;
+    }
+  } while (!line.empty());
 
-  s = std::make_unique<float3[]>(width * height);
+  int width, height;
+  if (!next_line(p, end, line) ||
+      sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2 ||
+      width <= 0 || height <= 0) {
+    return;
+  }
 
-  auto colr_buffer = std::make_unique<COLR[]>(width);
-  int y, x;
-  int i = 0;
-  for (y = 0; y < height; y++) {
-    if (freadcolrs(colr_buffer.get(), width, f) < 0) {
-      fclose(f);
+  // Where a scanline starts depends on all the previous ones, so only
+  // finding the starts is sequential. It reads a few bytes per run
+  std::vector<const unsigned char *> starts(height + 1);
+  starts[0] = p;
+  for (int y = 0; y < height; y++) {
+    starts[y + 1] = read_colrs(starts[y], end, width, nullptr);
+    if (!starts[y + 1]) {
       return;
     }
+  }
 
-    for (x = 0; x < width; x++) {
-      float3 color = colr_to_float3(colr_buffer[x]);
-      s[i++] = color;
+  // Not zeroed, every texel is stored by the decoding below, which also
+  // spreads the page faults of the first touch over the workers
+  Level &level = levels.emplace_back();
+  level.width = width;
+  level.height = height;
+  level.texels.reset(new unsigned char[(size_t)width * height * texel_size()]);
+  parallel_for(0, height, 0, [&](size_t begin, size_t end_y) {
+    std::vector<unsigned char> planes(4 * (size_t)width);
+    std::vector<float3> row(format == TexelFormat::Float ? 0 : width);
+    for (size_t y = begin; y < end_y; y++) {
+      // Cannot fail, the scanline was already read to find its end
+      read_colrs(starts[y], end, width, planes.data());
+      if (format == TexelFormat::Float) {
+        colrs_to_floats(planes.data(), width,
+                        reinterpret_cast<float3 *>(level.texels.get()) +
+                            y * width);
+      } else {
+        colrs_to_floats(planes.data(), width, row.data());
+        store_row(level, y, row.data());
+      }
     }
-  }
+  });
 
-  fclose(f);
+  build_pyramid();
   valid = true;
 }
+
+size_t HDRImage::texel_size() const {
+  switch (format) {
+  case TexelFormat::Float:
+    return sizeof(float3);
+  case TexelFormat::Half:
+    return sizeof(half3);
+  case TexelFormat::Rgb9e5:
+    return sizeof(uint32_t);
+  }
+  return 0;
+}
+
+size_t HDRImage::get_memory_size() const {
+  size_t size = 0;
+  for (const Level &level : levels) {
+    size += (size_t)level.width * level.height * texel_size();
+  }
+  return size;
+}
+
+float3 HDRImage::fetch(const Level &level, int x, int y) const {
+  const unsigned char *texel =
+      level.texels.get() + ((size_t)y * level.width + x) * texel_size();
+  switch (format) {
+  case TexelFormat::Float:
+    return *reinterpret_cast<const float3 *>(texel);
+  case TexelFormat::Half:
+    return reinterpret_cast<const half3 *>(texel)->to_float3();
+  case TexelFormat::Rgb9e5:
+    return rgb9e5_to_float3(*reinterpret_cast<const uint32_t *>(texel));
+  }
+  return float3::ZERO;
+}
+
+void HDRImage::store_row(Level &level, int y, const float3 *values) const {
+  unsigned char *row =
+      level.texels.get() + (size_t)y * level.width * texel_size();
+  // The format is decided once per row, not per texel
+  switch (format) {
+  case TexelFormat::Float:
+    for (int x = 0; x < level.width; x++) {
+      new (row + x * sizeof(float3)) float3(values[x]);
+    }
+    break;
+  case TexelFormat::Half:
+    for (int x = 0; x < level.width; x++) {
+      // Saturate rather than overflow to infinity
+      new (row + x * sizeof(half3))
+          half3(min(values[x], float3(65504.0f, 65504.0f, 65504.0f)));
+    }
+    break;
+  case TexelFormat::Rgb9e5:
+    for (int x = 0; x < level.width; x++) {
+      new (row + x * sizeof(uint32_t)) uint32_t(float3_to_rgb9e5(values[x]));
+    }
+    break;
+  }
+}
+
+void HDRImage::build_pyramid() {
+  while (levels.back().width > 1 || levels.back().height > 1) {
+    const Level &fine = levels.back();
+    Level coarse;
+    coarse.width = std::max(fine.width / 2, 1);
+    coarse.height = std::max(fine.height / 2, 1);
+    coarse.texels.reset(new unsigned char[(size_t)coarse.width *
+                                          coarse.height * texel_size()]);
+    parallel_for(0, coarse.height, 0, [&](size_t begin, size_t end) {
+      std::vector<float3> row(coarse.width);
+      for (size_t y = begin; y < end; y++) {
+        // Odd sizes drop the last row or column of the finer level
+        int y0 = std::min(2 * (int)y, fine.height - 1);
+        int y1 = std::min(2 * (int)y + 1, fine.height - 1);
+        for (int x = 0; x < coarse.width; x++) {
+          int x0 = std::min(2 * x, fine.width - 1);
+          int x1 = std::min(2 * x + 1, fine.width - 1);
+          row[x] = (fetch(fine, x0, y0) + fetch(fine, x1, y0) +
+                    fetch(fine, x0, y1) + fetch(fine, x1, y1)) *
+                   0.25f;
+        }
+        store_row(coarse, y, row.data());
+      }
+    });
+    // Moving the level into the vector invalidates fine
+    levels.push_back(std::move(coarse));
+  }
+}
+
+float3 HDRImage::bilinear(const Level &level, float theta, float phi) const {
+  // Texel centers are at half integers. NaN fails the comparisons and
+  // becomes 0
+  float u = phi * (float)(0.5 / M_PI);
+  float v = theta * (float)(1.0 / M_PI);
+  u -= floorf(u);
+  u = u > 0.0f ? (u < 1.0f ? u : 1.0f) : 0.0f;
+  v = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f;
+  float fx = u * level.width - 0.5f;
+  float fy = v * level.height - 0.5f;
+  // Both are at least -0.5, so truncating them shifted by one floors them
+  // without the range checks of floorf
+  int x0 = (int)(fx + 1.0f) - 1;
+  int y0 = (int)(fy + 1.0f) - 1;
+  float tx = fx - x0;
+  float ty = fy - y0;
+
+  // Longitude wraps around, latitude stops at the poles
+  int x1 = x0 + 1;
+  x0 = x0 < 0 ? x0 + level.width : x0;
+  x1 = x1 >= level.width ? x1 - level.width : x1;
+  int y1 = std::min(y0 + 1, level.height - 1);
+  y0 = std::max(y0, 0);
+
+  float3 c00 = fetch(level, x0, y0);
+  float3 c10 = fetch(level, x1, y0);
+  float3 c01 = fetch(level, x0, y1);
+  float3 c11 = fetch(level, x1, y1);
+  // Blends channels as plain floats, which stay in registers where the
+  // float3 operators would not be inlined
+  auto blend = [&](int i) {
+    float top = c00[i] * (1.0f - tx) + c10[i] * tx;
+    float bottom = c01[i] * (1.0f - tx) + c11[i] * tx;
+    return top * (1.0f - ty) + bottom * ty;
+  };
+  return float3(blend(0), blend(1), blend(2));
+}
+
+float3 HDRImage::get_color_spherical(float theta, float phi,
+                                     float footprint) const {
+  // Texels of level 0 are 2 pi / width wide, and each level doubles that
+  float lod = log2f(footprint * levels[0].width * (float)(0.5 / M_PI));
+  float max_lod = levels.size() - 1;
+  // Also takes 0 and NaN footprints to level 0
+  lod = lod > 0.0f ? (lod < max_lod ? lod : max_lod) : 0.0f;
+  int l0 = (int)lod;
+  float t = lod - l0;
+  float3 color = bilinear(levels[l0], theta, phi);
+  if (t > 0.0f) {
+    color = color * (1.0f - t) + bilinear(levels[l0 + 1], theta, phi) * t;
+  }
+  return color;
+}
 } // namespace verdant
@@ -1,27 +1,79 @@
 #pragma once
 #include "MathDefs.h"
+#include <cstddef>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace verdant {
+// In-memory format of the texels of an HDRImage
+enum class TexelFormat {
+  // Three floats, 12 bytes
+  Float,
+  // Three IEEE halves, 6 bytes. Relative error below 0.1%, and values
+  // above 65504 saturate
+  Half,
+  // Three 9 bit mantissas sharing a 5 bit exponent, 4 bytes. Error is
+  // relative to the brightest channel of a texel, see Rgb9e5.h
+  Rgb9e5
+};
+
+/**
+ * @brief Latitude-longitude environment map loaded from a Radiance RGBE
+ * file, with a mip pyramid for blurred lookups
+ *
+ * Rows go from theta = 0 at the top to pi at the bottom, and columns from
+ * phi = 0 around to 2 pi. Lookups filter bilinearly, wrap around in phi and
+ * clamp at the poles, so any angles are safe.
+ *
+ */
 class HDRImage {
 public:
-  HDRImage(const std::string &file_name);
+  HDRImage(const std::string &file_name,
+           TexelFormat format = TexelFormat::Float);
 
   bool is_valid() const { return valid; }
 
-  float3 get_color_spherical(float theta, float phi) {
-    int y = theta / M_PI * height;
-    int x = phi / M_PI / 2 * width;
-    int i = y * width + x;
-    return s[i];
+  int get_width() const { return levels.empty() ? 0 : levels[0].width; }
+  int get_height() const { return levels.empty() ? 0 : levels[0].height; }
+  TexelFormat get_format() const { return format; }
+  int get_level_count() const { return levels.size(); }
+  // Bytes of texels over all levels
+  size_t get_memory_size() const;
+
+  float3 get_color_spherical(float theta, float phi) const {
+    return bilinear(levels[0], theta, phi);
   }
 
+  /**
+   * @brief Looks up a cone of directions, such as the lobe of a rough
+   * material or the footprint of a ray differential. Interpolates between
+   * the two mip levels with texels closest to the cone in width
+   *
+   * @param footprint Width of the cone in radians, or 0 for the same lookup
+   * as without it
+   */
+  float3 get_color_spherical(float theta, float phi, float footprint) const;
+
 private:
+  struct Level {
+    int width;
+    int height;
+    // Texels in the format of the image, rows from top to bottom
+    std::unique_ptr<unsigned char[]> texels;
+  };
+
+  size_t texel_size() const;
+  float3 fetch(const Level &level, int x, int y) const;
+  // Stores a row of level.width texels, converted to the format
+  void store_row(Level &level, int y, const float3 *values) const;
+  float3 bilinear(const Level &level, float theta, float phi) const;
+
+  // Box filters each level into the next, down to one texel
+  void build_pyramid();
+
   bool valid;
-  int width;
-  int height;
-  // Image storage
-  std::unique_ptr<float3[]> s;
+  TexelFormat format;
+  std::vector<Level> levels;
 };
 } // namespace verdant
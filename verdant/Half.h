@@ -0,0 +1,75 @@
+#pragma once
+#include "MathDefs.h"
+#include <bit>
+#include <cstdint>
+
+namespace verdant {
+// IEEE 754 binary16. Conversions use integer operations only, so they work
+// without F16C or NEON half support and compilers can vectorize loops of them
+inline uint16_t float_to_half(float value) {
+  uint32_t f = std::bit_cast<uint32_t>(value);
+  uint32_t sign = (f >> 16) & 0x8000u;
+  uint32_t abs = f & 0x7fffffffu;
+
+  if (abs >= 0x7f800000u) {
+    // Inf stays Inf, NaN stays a quiet NaN
+    return sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0u);
+  }
+  if (abs >= 0x477ff000u) {
+    // Rounds to beyond the largest half, 65504
+    return sign | 0x7c00u;
+  }
+  if (abs < 0x38800000u) {
+    // Subnormal half, or 0. Shift the implicit bit in and round to nearest
+    // even at the new position
+    if (abs < 0x33000000u) {
+      return sign;
+    }
+    uint32_t exponent = abs >> 23;
+    uint32_t mantissa = (abs & 0x7fffffu) | 0x800000u;
+    uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  // Normal half: rebias the exponent and round the mantissa to nearest even.
+  // A carry out of the mantissa correctly bumps the exponent
+  uint32_t rounded = abs + 0xfffu + ((abs >> 13) & 1);
+  return sign | ((rounded - 0x38000000u) >> 13);
+}
+
+inline float half_to_float(uint16_t value) {
+  uint32_t sign = (uint32_t)(value & 0x8000u) << 16;
+  uint32_t exponent = (value >> 10) & 0x1fu;
+  uint32_t mantissa = value & 0x3ffu;
+
+  if (exponent == 0x1f) {
+    return std::bit_cast<float>(sign | 0x7f800000u | (mantissa << 13));
+  }
+  if (exponent == 0) {
+    // Subnormals are exact in float
+    float f = mantissa * 0x1p-24f;
+    return sign ? -f : f;
+  }
+  return std::bit_cast<float>(sign | ((exponent + 112) << 23) |
+                              (mantissa << 13));
+}
+
+// Three halves, half the size of float3
+struct half3 {
+  uint16_t x, y, z;
+
+  half3() : x(0), y(0), z(0) {}
+  explicit half3(float3 v)
+      : x(float_to_half(v.x())), y(float_to_half(v.y())),
+        z(float_to_half(v.z())) {}
+
+  float3 to_float3() const {
+    return {half_to_float(x), half_to_float(y), half_to_float(z)};
+  }
+};
+} // namespace verdant
@@ -0,0 +1,242 @@
+#include "ImageWriter.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+// Byte order of the formats does not depend on the host
+void put_u32(unsigned char *out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+void append_u32(std::vector<unsigned char> &out, uint32_t value) {
+  size_t at = out.size();
+  out.resize(at + 4);
+  put_u32(&out[at], value);
+}
+
+void append_u64(std::vector<unsigned char> &out, uint64_t value) {
+  append_u32(out, (uint32_t)value);
+  append_u32(out, (uint32_t)(value >> 32));
+}
+
+void append_float(std::vector<unsigned char> &out, float value) {
+  append_u32(out, std::bit_cast<uint32_t>(value));
+}
+
+void append_string(std::vector<unsigned char> &out, const std::string &s) {
+  out.insert(out.end(), s.begin(), s.end());
+  out.push_back(0);
+}
+
+void append_attribute_header(std::vector<unsigned char> &out,
+                             const std::string &name,
+                             const std::string &type, uint32_t size) {
+  append_string(out, name);
+  append_string(out, type);
+  append_u32(out, size);
+}
+
+void append_box2i(std::vector<unsigned char> &out, const std::string &name,
+                  unsigned int width, unsigned int height) {
+  append_attribute_header(out, name, "box2i", 16);
+  append_u32(out, 0);
+  append_u32(out, 0);
+  append_u32(out, width - 1);
+  append_u32(out, height - 1);
+}
+
+// Splits even and odd bytes, then replaces bytes by their differences, which
+// OpenEXR applies before RLE so that runs appear in smooth float data
+void exr_predict(const unsigned char *in, size_t size, unsigned char *out) {
+  unsigned char *t1 = out;
+  unsigned char *t2 = out + (size + 1) / 2;
+  for (size_t i = 0; i < size; i++) {
+    if (i % 2 == 0) {
+      *t1++ = in[i];
+    } else {
+      *t2++ = in[i];
+    }
+  }
+
+  unsigned char prev = out[0];
+  for (size_t i = 1; i < size; i++) {
+    unsigned char d = (unsigned char)(out[i] - prev + 128);
+    prev = out[i];
+    out[i] = d;
+  }
+}
+
+// OpenEXR's run length encoding: a count byte n >= 0 repeats the next byte
+// n + 1 times, n < 0 copies the next -n bytes
+void exr_rle(const unsigned char *in, size_t size,
+             std::vector<unsigned char> &out) {
+  const size_t min_run = 3;
+  const size_t max_run = 127;
+  const unsigned char *end = in + size;
+  const unsigned char *run_start = in;
+  const unsigned char *run_end = in + 1;
+
+  while (run_start < end) {
+    while (run_end < end && *run_start == *run_end &&
+           (size_t)(run_end - run_start - 1) < max_run) {
+      run_end++;
+    }
+    if ((size_t)(run_end - run_start) >= min_run) {
+      out.push_back((unsigned char)(run_end - run_start - 1));
+      out.push_back(*run_start);
+      run_start = run_end;
+    } else {
+      // Literals up to the next run of three equal bytes
+      while (run_end < end &&
+             ((run_end + 1 >= end || run_end[0] != run_end[1]) ||
+              (run_end + 2 >= end || run_end[1] != run_end[2])) &&
+             (size_t)(run_end - run_start) < max_run) {
+        run_end++;
+      }
+      out.push_back((unsigned char)-(int)(run_end - run_start));
+      out.insert(out.end(), run_start, run_end);
+      run_start = run_end;
+    }
+    run_end++;
+  }
+}
+} // namespace
+
+namespace verdant {
+bool ImageWriter::write_file(const std::string &file_name,
+                             const std::vector<unsigned char> &bytes) {
+  FILE *file = fopen(file_name.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  return fclose(file) == 0 && written;
+}
+
+bool ImageWriter::write_ppm(const std::string &file_name, unsigned int width,
+                            unsigned int height, const unsigned char *rgb) {
+  std::string header = "P6\n" + std::to_string(width) + " " +
+                       std::to_string(height) + "\n255\n";
+  size_t data_size = (size_t)width * height * 3;
+  std::vector<unsigned char> bytes(header.size() + data_size);
+  memcpy(bytes.data(), header.data(), header.size());
+  memcpy(bytes.data() + header.size(), rgb, data_size);
+  return write_file(file_name, bytes);
+}
+
+bool ImageWriter::write_pfm(const std::string &file_name, unsigned int width,
+                            unsigned int height, const float *rgb) {
+  // A negative scale marks little endian data
+  std::string header = "PF\n" + std::to_string(width) + " " +
+                       std::to_string(height) + "\n-1.0\n";
+  size_t row_size = (size_t)width * 3 * 4;
+  std::vector<unsigned char> bytes(header.size() + row_size * height);
+  memcpy(bytes.data(), header.data(), header.size());
+
+  unsigned char *data = bytes.data() + header.size();
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    for (size_t y = begin; y < end; y++) {
+      // Rows are stored from the bottom up
+      unsigned char *out = data + (height - 1 - y) * row_size;
+      const float *in = rgb + y * width * 3;
+      for (size_t i = 0; i < (size_t)width * 3; i++) {
+        put_u32(out + i * 4, std::bit_cast<uint32_t>(in[i]));
+      }
+    }
+  });
+  return write_file(file_name, bytes);
+}
+
+bool ImageWriter::write_exr(const std::string &file_name, unsigned int width,
+                            unsigned int height,
+                            std::vector<ImageChannel> channels,
+                            ExrCompression compression) {
+  std::sort(channels.begin(), channels.end(),
+            [](const ImageChannel &a, const ImageChannel &b) {
+              return a.name < b.name;
+            });
+
+  std::vector<unsigned char> bytes;
+  append_u32(bytes, 20000630);
+  // Version 2, single part scanline image
+  append_u32(bytes, 2);
+
+  size_t chlist_size = 1;
+  for (const ImageChannel &channel : channels) {
+    chlist_size += channel.name.size() + 1 + 16;
+  }
+  append_attribute_header(bytes, "channels", "chlist", chlist_size);
+  for (const ImageChannel &channel : channels) {
+    append_string(bytes, channel.name);
+    // FLOAT, not perceptually linear, reserved, x and y sampling
+    append_u32(bytes, 2);
+    append_u32(bytes, 0);
+    append_u32(bytes, 1);
+    append_u32(bytes, 1);
+  }
+  bytes.push_back(0);
+
+  append_attribute_header(bytes, "compression", "compression", 1);
+  bytes.push_back(compression == ExrCompression::Rle ? 1 : 0);
+  append_box2i(bytes, "dataWindow", width, height);
+  append_box2i(bytes, "displayWindow", width, height);
+  append_attribute_header(bytes, "lineOrder", "lineOrder", 1);
+  // Increasing y
+  bytes.push_back(0);
+  append_attribute_header(bytes, "pixelAspectRatio", "float", 4);
+  append_float(bytes, 1.0f);
+  append_attribute_header(bytes, "screenWindowCenter", "v2f", 8);
+  append_float(bytes, 0.0f);
+  append_float(bytes, 0.0f);
+  append_attribute_header(bytes, "screenWindowWidth", "float", 4);
+  append_float(bytes, 1.0f);
+  bytes.push_back(0);
+
+  // Encode every scanline on its own, then lay them out after the offsets
+  size_t line_size = (size_t)width * channels.size() * 4;
+  std::vector<std::vector<unsigned char>> lines(height);
+  parallel_for(0, height, 0, [&](size_t begin, size_t end) {
+    std::vector<unsigned char> raw(line_size);
+    std::vector<unsigned char> predicted(line_size);
+    for (size_t y = begin; y < end; y++) {
+      unsigned char *out = raw.data();
+      for (const ImageChannel &channel : channels) {
+        const float *in = channel.data + y * width * channel.stride;
+        for (unsigned int x = 0; x < width; x++, out += 4) {
+          put_u32(out, std::bit_cast<uint32_t>(in[x * channel.stride]));
+        }
+      }
+
+      std::vector<unsigned char> &line = lines[y];
+      if (compression == ExrCompression::Rle) {
+        exr_predict(raw.data(), line_size, predicted.data());
+        exr_rle(predicted.data(), line_size, line);
+      }
+      if (compression == ExrCompression::None || line.size() >= line_size) {
+        line = raw;
+      }
+    }
+  });
+
+  uint64_t offset = bytes.size() + (uint64_t)height * 8;
+  for (unsigned int y = 0; y < height; y++) {
+    append_u64(bytes, offset);
+    offset += 8 + lines[y].size();
+  }
+  bytes.reserve(offset);
+  for (unsigned int y = 0; y < height; y++) {
+    append_u32(bytes, y);
+    append_u32(bytes, lines[y].size());
+    bytes.insert(bytes.end(), lines[y].begin(), lines[y].end());
+  }
+  return write_file(file_name, bytes);
+}
+} // namespace verdant
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace verdant {
+enum class ExrCompression { None, Rle };
+
+// One channel of an image, the value of pixel x, y is at
+// data[(y * width + x) * stride]
+struct ImageChannel {
+  std::string name;
+  const float *data;
+  size_t stride;
+};
+
+/**
+ * @brief Writes images in binary formats. Each file is encoded into memory in
+ * parallel and written with a single call, so writing does not flush per row
+ *
+ * Functions return false if the file could not be written.
+ *
+ */
+class ImageWriter {
+public:
+  // Binary P6 ppm of 8 bit RGB, rows from top to bottom
+  static bool write_ppm(const std::string &file_name, unsigned int width,
+                        unsigned int height, const unsigned char *rgb);
+
+  // Little endian PFM of linear float RGB, rows from top to bottom
+  static bool write_pfm(const std::string &file_name, unsigned int width,
+                        unsigned int height, const float *rgb);
+
+  /**
+   * @brief Scanline OpenEXR of 32 bit float channels, one scanline per chunk
+   *
+   * @param channels Channels in any order, they are sorted by name as the
+   * format requires
+   * @param compression Lines that RLE does not shrink are stored as is
+   */
+  static bool write_exr(const std::string &file_name, unsigned int width,
+                        unsigned int height,
+                        std::vector<ImageChannel> channels,
+                        ExrCompression compression = ExrCompression::Rle);
+
+private:
+  static bool write_file(const std::string &file_name,
+                         const std::vector<unsigned char> &bytes);
+};
+} // namespace verdant
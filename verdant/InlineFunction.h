@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace verdant {
+/**
+ * @brief A void() callable stored in place when it fits into Capacity bytes,
+ * so that wrapping a small lambda does not allocate. Larger callables fall
+ * back to the heap
+ *
+ * Neither copyable nor movable, it is meant to live inside its owner, such as
+ * a Task.
+ *
+ */
+template <size_t Capacity> class InlineFunction {
+public:
+  InlineFunction() = default;
+
+  template <typename Fn> explicit InlineFunction(Fn &&fn) {
+    using F = std::decay_t<Fn>;
+    if constexpr (sizeof(F) <= Capacity &&
+                  alignof(F) <= alignof(std::max_align_t)) {
+      new (storage) F(std::forward<Fn>(fn));
+      invoke_fn = [](void *p) { (*static_cast<F *>(p))(); };
+      destroy_fn = [](void *p) { static_cast<F *>(p)->~F(); };
+    } else {
+      new (storage) F *(new F(std::forward<Fn>(fn)));
+      invoke_fn = [](void *p) { (**static_cast<F **>(p))(); };
+      destroy_fn = [](void *p) { delete *static_cast<F **>(p); };
+    }
+  }
+
+  InlineFunction(const InlineFunction &) = delete;
+  InlineFunction &operator=(const InlineFunction &) = delete;
+
+  ~InlineFunction() { reset(); }
+
+  void operator()() { invoke_fn(storage); }
+  explicit operator bool() const { return invoke_fn != nullptr; }
+
+  // Destroys the callable and whatever it captured
+  void reset() {
+    if (destroy_fn) {
+      destroy_fn(storage);
+    }
+    invoke_fn = nullptr;
+    destroy_fn = nullptr;
+  }
+
+private:
+  alignas(std::max_align_t) unsigned char storage[Capacity];
+  void (*invoke_fn)(void *) = nullptr;
+  void (*destroy_fn)(void *) = nullptr;
+};
+} // namespace verdant
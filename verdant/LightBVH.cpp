@@ -0,0 +1,337 @@
+#include "LightBVH.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numeric>
+
+namespace {
+using verdant::BBox3;
+using verdant::float3;
+using verdant::LightBounds;
+
+const float ONE_MINUS_EPSILON = 0x1.fffffep-1f;
+const int BUCKET_COUNT = 12;
+
+float safe_sqrt(float x) { return sqrtf(std::max(0.0f, x)); }
+
+float safe_acos(float x) { return acosf(std::clamp(x, -1.0f, 1.0f)); }
+
+// cos(max(0, a - b)) given the sines and cosines of a and b
+float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+  if (cos_a > cos_b) {
+    return 1.0f;
+  }
+  return cos_a * cos_b + sin_a * sin_b;
+}
+
+// sin(max(0, a - b)) given the sines and cosines of a and b
+float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+  if (cos_a > cos_b) {
+    return 0.0f;
+  }
+  return sin_a * cos_b - cos_a * sin_b;
+}
+
+// Cosine of the half angle of the cone of directions from p to the box
+float bound_subtended_directions(const BBox3 &b, const float3 &p) {
+  float3 center = b.centroid();
+  float radius2 = b.get_extent().squared_length() / 4;
+  float dist2 = (p - center).squared_length();
+  if (dist2 < radius2) {
+    return -1.0f;
+  }
+  float sin2_theta_max = radius2 / dist2;
+  return safe_sqrt(1 - sin2_theta_max);
+}
+
+// Surface area orientation heuristic from PBRT-v4
+float evaluate_cost(const LightBounds &b, const BBox3 &bounds, int axis) {
+  float theta_o = safe_acos(b.cos_theta_o);
+  float theta_e = safe_acos(b.cos_theta_e);
+  float theta_w = std::min(theta_o + theta_e, (float)M_PI);
+  float sin_theta_o = safe_sqrt(1 - b.cos_theta_o * b.cos_theta_o);
+  float M_omega =
+      2 * M_PI * (1 - b.cos_theta_o) +
+      M_PI / 2 *
+          (2 * theta_w * sin_theta_o - cosf(theta_o - 2 * theta_w) -
+           2 * theta_o * sin_theta_o + b.cos_theta_o);
+  float3 d = bounds.get_extent();
+  float Kr = std::max({d.x(), d.y(), d.z()}) / d[axis];
+  return b.phi * M_omega * Kr * b.bounds.surface_area();
+}
+} // namespace
+
+namespace verdant {
+float LightBounds::importance(const float3 &p, const float3 &n) const {
+  float3 pc = bounds.centroid();
+  float d2 = (p - pc).squared_length();
+  d2 = std::max(d2, bounds.get_extent().length() / 2);
+
+  float3 wi = p - pc;
+  if (wi.squared_length() > 0.0f) {
+    wi.normalize();
+  }
+  float cos_theta_w = dot(w, wi);
+  if (two_sided) {
+    cos_theta_w = std::abs(cos_theta_w);
+  }
+  float sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+
+  float cos_theta_b = bound_subtended_directions(bounds, p);
+  float sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+
+  // Minimum angle between the emitter normals and the direction to p
+  float sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+  float cos_theta_x =
+      cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+  float sin_theta_x =
+      sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+  float cos_theta_p =
+      cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+  if (cos_theta_p <= cos_theta_e) {
+    return 0.0f;
+  }
+
+  float result = phi * cos_theta_p / d2;
+  if (n.squared_length() > 0.0f) {
+    float cos_theta_i = std::abs(dot(wi, n));
+    float sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+    result *=
+        cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+  }
+  return std::max(result, 0.0f);
+}
+
+LightBounds LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+  if (a.phi == 0.0f) {
+    return b;
+  }
+  if (b.phi == 0.0f) {
+    return a;
+  }
+
+  LightBounds r;
+  r.bounds = a.bounds;
+  r.bounds.expand(b.bounds);
+  r.phi = a.phi + b.phi;
+  r.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+  r.two_sided = a.two_sided || b.two_sided;
+
+  // Union of the two normal cones
+  float theta_a = safe_acos(a.cos_theta_o);
+  float theta_b = safe_acos(b.cos_theta_o);
+  float theta_d = safe_acos(dot(a.w, b.w));
+  if (std::min(theta_d + theta_b, (float)M_PI) <= theta_a) {
+    r.w = a.w;
+    r.cos_theta_o = a.cos_theta_o;
+    return r;
+  }
+  if (std::min(theta_d + theta_a, (float)M_PI) <= theta_b) {
+    r.w = b.w;
+    r.cos_theta_o = b.cos_theta_o;
+    return r;
+  }
+
+  float theta_o = (theta_a + theta_d + theta_b) / 2;
+  float3 wr = a.w.cross(b.w);
+  if (theta_o >= M_PI || wr.squared_length() == 0.0f) {
+    r.w = a.w;
+    r.cos_theta_o = -1.0f;
+    return r;
+  }
+
+  // Rotate a.w towards b.w around wr, which is orthogonal to a.w
+  float theta_r = theta_o - theta_a;
+  wr.normalize();
+  r.w = a.w * cosf(theta_r) + wr.cross(a.w) * sinf(theta_r);
+  r.w.normalize();
+  r.cos_theta_o = cosf(theta_o);
+  return r;
+}
+
+LightBVH::LightBVH(const std::vector<LightBounds> &lights) {
+  std::vector<unsigned int> indices;
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    // Lights that emit nothing can never be chosen
+    if (lights[i].phi > 0.0f) {
+      indices.push_back(i);
+    }
+  }
+
+  light_trails.resize(lights.size());
+  if (!indices.empty()) {
+    build_from(lights, indices, 0, indices.size(), 0, 0);
+  }
+}
+
+unsigned int LightBVH::build_from(const std::vector<LightBounds> &lights,
+                                  std::vector<unsigned int> &indices,
+                                  size_t begin, size_t end, uint64_t bit_trail,
+                                  int depth) {
+  if (end - begin == 1) {
+    unsigned int node_index = nodes.size();
+    nodes.push_back({lights[indices[begin]], indices[begin], true});
+    light_trails[indices[begin]] = bit_trail;
+    return node_index;
+  }
+
+  BBox3 bounds, centroid_bounds;
+  for (size_t i = begin; i < end; i++) {
+    const LightBounds &lb = lights[indices[i]];
+    bounds.expand(lb.bounds);
+    centroid_bounds.expand(lb.bounds.centroid());
+  }
+
+  // Bucketed split along the axis minimizing the orientation heuristic
+  float min_cost = INFINITY;
+  int min_axis = -1;
+  int min_bucket = -1;
+  float3 centroid_extent = centroid_bounds.get_extent();
+  for (int axis = 0; axis < 3; axis++) {
+    if (centroid_extent[axis] <= 0.0f || bounds.get_extent()[axis] <= 0.0f) {
+      continue;
+    }
+
+    LightBounds buckets[BUCKET_COUNT];
+    for (size_t i = begin; i < end; i++) {
+      const LightBounds &lb = lights[indices[i]];
+      float3 c = lb.bounds.centroid();
+      int b = BUCKET_COUNT * (c[axis] - centroid_bounds.get_min()[axis]) /
+              centroid_extent[axis];
+      b = std::clamp(b, 0, BUCKET_COUNT - 1);
+      buckets[b] = LightBounds::merge(buckets[b], lb);
+    }
+
+    for (int split = 0; split < BUCKET_COUNT - 1; split++) {
+      LightBounds below, above;
+      for (int b = 0; b <= split; b++) {
+        below = LightBounds::merge(below, buckets[b]);
+      }
+      for (int b = split + 1; b < BUCKET_COUNT; b++) {
+        above = LightBounds::merge(above, buckets[b]);
+      }
+      if (below.phi == 0.0f || above.phi == 0.0f) {
+        continue;
+      }
+      float cost = evaluate_cost(below, bounds, axis) +
+                   evaluate_cost(above, bounds, axis);
+      if (cost < min_cost) {
+        min_cost = cost;
+        min_axis = axis;
+        min_bucket = split;
+      }
+    }
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  // The bit trail holds 64 levels. Median splits put the deepest leaf below
+  // here at depth + ceil(log2(count)), so the orientation heuristic is only
+  // trusted while an uneven split would still leave room for them
+  int median_levels = std::bit_width(end - begin - 1);
+  if (min_axis >= 0 && depth + 1 + median_levels <= 64) {
+    auto mid_iter = std::partition(
+        indices.begin() + begin, indices.begin() + end, [&](unsigned int i) {
+          float3 c = lights[i].bounds.centroid();
+          int b = BUCKET_COUNT *
+                  (c[min_axis] - centroid_bounds.get_min()[min_axis]) /
+                  centroid_extent[min_axis];
+          b = std::clamp(b, 0, BUCKET_COUNT - 1);
+          return b <= min_bucket;
+        });
+    size_t split = mid_iter - indices.begin();
+    if (split != begin && split != end) {
+      mid = split;
+    }
+  }
+
+  unsigned int node_index = nodes.size();
+  nodes.push_back({});
+  unsigned int child0 =
+      build_from(lights, indices, begin, mid, bit_trail, depth + 1);
+  unsigned int child1 = build_from(lights, indices, mid, end,
+                                   bit_trail | (uint64_t(1) << depth),
+                                   depth + 1);
+
+  LightBVHNode &node = nodes[node_index];
+  node.bounds = LightBounds::merge(nodes[child0].bounds, nodes[child1].bounds);
+  node.index = child1;
+  node.is_leaf = false;
+  return node_index;
+}
+
+bool LightBVH::sample(const float3 &p, const float3 &n, float u,
+                      unsigned int &light_index, float &pmf) const {
+  if (nodes.empty()) {
+    return false;
+  }
+
+  unsigned int node_index = 0;
+  pmf = 1.0f;
+  while (true) {
+    const LightBVHNode &node = nodes[node_index];
+    if (node.is_leaf) {
+      if (node_index > 0 || node.bounds.importance(p, n) > 0.0f) {
+        light_index = node.index;
+        return true;
+      }
+      return false;
+    }
+
+    float c0 = nodes[node_index + 1].bounds.importance(p, n);
+    float c1 = nodes[node.index].bounds.importance(p, n);
+    if (c0 == 0.0f && c1 == 0.0f) {
+      return false;
+    }
+
+    // Pick a child and remap u so it can be reused further down
+    float p0 = c0 / (c0 + c1);
+    if (u < p0) {
+      node_index = node_index + 1;
+      pmf *= p0;
+      u = std::min(u / p0, ONE_MINUS_EPSILON);
+    } else {
+      node_index = node.index;
+      pmf *= 1 - p0;
+      u = std::min((u - p0) / (1 - p0), ONE_MINUS_EPSILON);
+    }
+  }
+}
+
+float LightBVH::pmf(const float3 &p, const float3 &n,
+                    unsigned int light_index) const {
+  if (nodes.empty()) {
+    return 0.0f;
+  }
+
+  uint64_t bit_trail = light_trails[light_index];
+  unsigned int node_index = 0;
+  float pmf = 1.0f;
+  while (true) {
+    const LightBVHNode &node = nodes[node_index];
+    if (node.is_leaf) {
+      if (node.index != light_index) {
+        return 0.0f;
+      }
+      if (node_index == 0 && node.bounds.importance(p, n) == 0.0f) {
+        return 0.0f;
+      }
+      return pmf;
+    }
+
+    float c0 = nodes[node_index + 1].bounds.importance(p, n);
+    float c1 = nodes[node.index].bounds.importance(p, n);
+    if (c0 == 0.0f && c1 == 0.0f) {
+      return 0.0f;
+    }
+
+    if (bit_trail & 1) {
+      pmf *= c1 / (c0 + c1);
+      node_index = node.index;
+    } else {
+      pmf *= c0 / (c0 + c1);
+      node_index = node_index + 1;
+    }
+    bit_trail >>= 1;
+  }
+}
+} // namespace verdant
@@ -0,0 +1,65 @@
+#pragma once
+#include "BBox3.h"
+#include "MathDefs.h"
+#include <cstdint>
+#include <vector>
+
+namespace verdant {
+// Conservative spatial and directional bounds of the emission of one or more
+// lights, following the light bounds of PBRT-v4's BVHLightSampler
+struct LightBounds {
+  BBox3 bounds;
+  // Axis of the cone bounding all emitter normals
+  float3 w;
+  // Total emitted power
+  float phi = 0.0f;
+  // Half angle of the normal cone
+  float cos_theta_o = 1.0f;
+  // Spread of emission around each normal, pi/2 for diffuse emitters
+  float cos_theta_e = 0.0f;
+  bool two_sided = false;
+
+  // Estimate of the contribution to a shading point p with normal n
+  float importance(const float3 &p, const float3 &n) const;
+
+  static LightBounds merge(const LightBounds &a, const LightBounds &b);
+};
+
+class LightBVHNode {
+public:
+  LightBounds bounds;
+  // Index of the second child for interior nodes, index of the light for
+  // leaves. The first child of an interior node immediately follows it
+  unsigned int index;
+  bool is_leaf;
+};
+
+// Light tree used to pick one light out of many with probability roughly
+// proportional to its contribution at a shading point. Sampling and pmf
+// evaluation are O(log n) in the number of lights
+class LightBVH {
+public:
+  LightBVH() = default;
+  explicit LightBVH(const std::vector<LightBounds> &lights);
+
+  bool empty() const { return nodes.empty(); }
+
+  // Chooses a light given a uniform u in [0, 1). Returns false when no light
+  // can illuminate p
+  bool sample(const float3 &p, const float3 &n, float u,
+              unsigned int &light_index, float &pmf) const;
+
+  // Probability of sample choosing light_index at p
+  float pmf(const float3 &p, const float3 &n, unsigned int light_index) const;
+
+private:
+  unsigned int build_from(const std::vector<LightBounds> &lights,
+                          std::vector<unsigned int> &indices, size_t begin,
+                          size_t end, uint64_t bit_trail, int depth);
+
+  std::vector<LightBVHNode> nodes;
+  // Path from the root to each light, one bit per level: 0 for the first
+  // child, 1 for the second
+  std::vector<uint64_t> light_trails;
+};
+} // namespace verdant
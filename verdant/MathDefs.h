@@ -70,13 +70,19 @@ public:
 
 // Forward declaration for Intersection members
 class Surface;
+class Primitive;
 
 // Intersection is the main interface between Scene and the rest of the ray
 // tracer
 struct Intersection {
   float t;
+  // Shading normal, which may be interpolated
   float3 normal;
+  // Normal of the surface itself. Area densities convert to solid angle
+  // with it, never with the shading normal
+  float3 geometric_normal;
   std::shared_ptr<Surface> material;
+  const Primitive *primitive = nullptr;
 
   float3x3 make_tangent_basis() const {
     float3 i, j, k;
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace verdant {
+/**
+ * @brief Free-list allocator for objects of type T, used through the
+ * class-specific operator new and delete of T
+ *
+ * Every thread keeps its own list of free blocks and needs no lock in the
+ * common case. Threads that free more than they allocate hand batches of
+ * blocks to a shared list, where threads that run dry pick them up before
+ * allocating new slabs. Memory is never returned to the system.
+ *
+ */
+template <typename T> class ObjectPool {
+public:
+  static void *allocate() {
+    LocalList &list = local;
+    if (!list.head) {
+      refill(list);
+    }
+    Block *block = list.head;
+    list.head = block->next;
+    list.count--;
+    return block;
+  }
+
+  static void deallocate(void *p) {
+    LocalList &list = local;
+    Block *block = static_cast<Block *>(p);
+    block->next = list.head;
+    list.head = block;
+    list.count++;
+    if (list.count >= 2 * batch_size) {
+      release_batch(list, batch_size);
+    }
+  }
+
+private:
+  union Block {
+    Block *next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  struct LocalList {
+    Block *head = nullptr;
+    size_t count = 0;
+
+    // Blocks of exiting threads go back to the shared list
+    ~LocalList() {
+      if (count > 0) {
+        release_batch(*this, count);
+      }
+    }
+  };
+
+  static constexpr size_t batch_size = 64;
+
+  static void refill(LocalList &list) {
+    std::unique_lock<std::mutex> lk(shared_mut);
+    if (!shared_batches.empty()) {
+      std::tie(list.head, list.count) = shared_batches.back();
+      shared_batches.pop_back();
+      return;
+    }
+
+    slabs.emplace_back(new Block[batch_size]);
+    Block *slab = slabs.back().get();
+    for (size_t i = 0; i + 1 < batch_size; i++) {
+      slab[i].next = &slab[i + 1];
+    }
+    slab[batch_size - 1].next = nullptr;
+    list.head = slab;
+    list.count = batch_size;
+  }
+
+  // Moves the first count blocks of list to the shared list
+  static void release_batch(LocalList &list, size_t count) {
+    Block *first = list.head;
+    Block *last = first;
+    for (size_t i = 1; i < count; i++) {
+      last = last->next;
+    }
+    list.head = last->next;
+    list.count -= count;
+    last->next = nullptr;
+
+    std::unique_lock<std::mutex> lk(shared_mut);
+    shared_batches.emplace_back(first, count);
+  }
+
+  static inline thread_local LocalList local;
+  static inline std::mutex shared_mut;
+  static inline std::vector<std::pair<Block *, size_t>> shared_batches;
+  static inline std::vector<std::unique_ptr<Block[]>> slabs;
+};
+} // namespace verdant
@@ -0,0 +1,96 @@
+#pragma once
+#include "TaskQueue.h"
+#include <algorithm>
+#include <cstddef>
+
+namespace verdant {
+namespace detail {
+// Enough chunks for every thread to steal a few times
+inline size_t default_grain(TaskQueue &queue, size_t count) {
+  return std::max<size_t>(1, count / (8 * queue.get_concurrency()));
+}
+
+// Hands the upper half of [begin, end) to the queue and recurses into the
+// lower half on the calling thread, down to ranges no larger than grain
+template <typename Fn>
+void parallel_for_split(TaskQueue &queue, size_t begin, size_t end,
+                        size_t grain, const Fn &fn) {
+  if (end - begin <= grain) {
+    fn(begin, end);
+    return;
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  TaskHandle upper_task = queue.enqueue([&queue, mid, end, grain, &fn]() {
+    parallel_for_split(queue, mid, end, grain, fn);
+  });
+  parallel_for_split(queue, begin, mid, grain, fn);
+  queue.wait(upper_task);
+}
+
+template <typename T, typename Fn, typename Combine>
+T parallel_reduce_split(TaskQueue &queue, size_t begin, size_t end,
+                        size_t grain, const T &identity, const Fn &fn,
+                        const Combine &combine) {
+  if (end - begin <= grain) {
+    return fn(begin, end, identity);
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  T upper = identity;
+  TaskHandle upper_task = queue.enqueue([&]() {
+    upper = parallel_reduce_split(queue, mid, end, grain, identity, fn,
+                                  combine);
+  });
+  T lower =
+      parallel_reduce_split(queue, begin, mid, grain, identity, fn, combine);
+  queue.wait(upper_task);
+  return combine(lower, upper);
+}
+} // namespace detail
+
+/**
+ * @brief Calls fn(chunk_begin, chunk_end) on disjoint chunks covering
+ * [begin, end) in parallel, and returns once all of them finished
+ *
+ * The calling thread runs chunks as well, so this may be used from inside
+ * tasks and without any workers. A grain of 0 sizes chunks from the number of
+ * workers, otherwise chunks are at most grain long.
+ *
+ */
+template <typename Fn>
+void parallel_for(size_t begin, size_t end, size_t grain, const Fn &fn) {
+  if (begin >= end) {
+    return;
+  }
+  TaskQueue &queue = TaskQueue::default_queue();
+  if (grain == 0) {
+    grain = detail::default_grain(queue, end - begin);
+  }
+  detail::parallel_for_split(queue, begin, end, grain, fn);
+}
+
+/**
+ * @brief Reduces [begin, end) in parallel. fn(chunk_begin, chunk_end, init)
+ * folds a chunk into init and returns the result, combine(a, b) merges the
+ * results of two neighbouring ranges
+ *
+ * Chunks only depend on the range and grain, and are combined in the same
+ * order every time, so floating point results are reproducible for a given
+ * grain.
+ *
+ */
+template <typename T, typename Fn, typename Combine>
+T parallel_reduce(size_t begin, size_t end, size_t grain, T identity,
+                  const Fn &fn, const Combine &combine) {
+  if (begin >= end) {
+    return identity;
+  }
+  TaskQueue &queue = TaskQueue::default_queue();
+  if (grain == 0) {
+    grain = detail::default_grain(queue, end - begin);
+  }
+  return detail::parallel_reduce_split(queue, begin, end, grain, identity, fn,
+                                       combine);
+}
+} // namespace verdant
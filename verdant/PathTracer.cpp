@@ -1,17 +1,36 @@
 #include "PathTracer.h"
 #include <cassert>
 
+namespace {
+// Veach's power heuristic with beta = 2 for one sample of each strategy
+float power_heuristic(float pdf_f, float pdf_g) {
+  float f2 = pdf_f * pdf_f;
+  float g2 = pdf_g * pdf_g;
+  if (f2 + g2 == 0.0f) {
+    return 0.0f;
+  }
+  return f2 / (f2 + g2);
+}
+} // namespace
+
 namespace verdant {
 // Implements the classical Kajiya path-tracing
-PathTracer::PathTracer(const Scene &scene, UniformSampler &sampler)
+PathTracer::PathTracer(const Scene &scene, Sampler &sampler)
     : scene(scene), sampler(sampler) {}
 
-float3 PathTracer::radiance(const Ray &in_ray) {
+float3 PathTracer::radiance(const Ray &in_ray, AovSample *aov) {
   Ray ray = in_ray;
   bool specular_bounce = false;
   float3 beta(1, 1, 1);
   float3 L_out(0, 0, 0);
   const CosineWeightedHemisphereDistribution dist;
+  // Radiance is split into lobes by the first surface, see Lobe
+  Lobe lobe = Lobe::Diffuse;
+  float3 L_emission(0, 0, 0);
+  bool guides_found = false;
+  if (aov) {
+    *aov = AovSample();
+  }
 
   for (unsigned int bounces = 0; bounces <= 5; bounces++) {
     // printf("Bounce %d\n", bounces);
@@ -30,11 +49,25 @@ float3 PathTracer::radiance(const Ray &in_ray) {
     // emission
     if (bounces == 0 || specular_bounce) {
       if (hit) {
-        // TODO: emissive objects
+        L_out += isect.material->Le(isect.normal, -ray.dir) * beta;
       } else {
         L_out += scene.get_sky_light(ray.dir) * beta;
       }
     }
+    if (aov && bounces == 0) {
+      L_emission = L_out;
+      if (hit) {
+        aov->depth = isect.t;
+        aov->primitive_id = scene.get_primitive_index(isect.primitive);
+        lobe = isect.material->is_delta() ? Lobe::Specular : Lobe::Diffuse;
+      }
+    }
+    if (aov && hit && !guides_found && !isect.material->is_delta()) {
+      // Guides come from the first surface that is not a mirror or glass
+      aov->albedo = isect.material->get_albedo() * beta;
+      aov->normal = isect.normal;
+      guides_found = true;
+    }
     if (!hit) {
       break;
     }
@@ -49,17 +82,44 @@ float3 PathTracer::radiance(const Ray &in_ray) {
     // Sample direct lighting
     if (!isect.material->is_delta()) {
       const int n_direct = 4;
+      bool area_lights = scene.has_area_lights();
       for (int i = 0; i < n_direct; i++) {
         auto [pdf, L] = dist.sample(sampler);
         Ray next_ray(world_pos + L2W * L * RAY_EPS, L2W * L);
         Intersection next_isect;
         bool hit = scene.intersect(next_ray, next_isect);
         if (hit) {
-          // TODO: emissive objects
+          float3 Le = next_isect.material->Le(next_isect.normal, -next_ray.dir);
+          if (Le != float3::ZERO) {
+            // Area lights are also sampled directly below, so weight the two
+            // strategies with multiple importance sampling
+            float light_pdf = scene.area_light_pdf(world_pos, isect.normal,
+                                                   next_ray, next_isect);
+            L_out += isect.material->f(L, V) * Le * L.z() / pdf / n_direct *
+                     power_heuristic(pdf, light_pdf) * beta;
+          }
         } else {
           L_out += isect.material->f(L, V) * scene.get_sky_light(next_ray.dir) *
                    L.z() / pdf / n_direct * beta;
         }
+
+        LightSample ls;
+        if (area_lights &&
+            scene.sample_area_light(world_pos, isect.normal, sampler, ls)) {
+          float3 L_light = W2L * ls.wi;
+          if (L_light.z() <= 0.0f || ls.Le == float3::ZERO) {
+            continue;
+          }
+          Ray shadow_ray(world_pos + ls.wi * RAY_EPS, ls.wi);
+          Intersection shadow_isect;
+          if (!scene.intersect(shadow_ray, shadow_isect) ||
+              shadow_isect.primitive != ls.primitive) {
+            continue;
+          }
+          float w = power_heuristic(ls.pdf, dist.pdf(L_light));
+          L_out += isect.material->f(L_light, V) * ls.Le * L_light.z() /
+                   ls.pdf / n_direct * w * beta;
+        }
       }
     }
 
@@ -77,6 +137,11 @@ float3 PathTracer::radiance(const Ray &in_ray) {
     ray = Ray(world_pos + L2W * L * RAY_EPS, L2W * L);
     beta *= fr * fabs(L.z()) / pdf;
   }
+
+  if (aov) {
+    aov->lobes[(int)Lobe::Emission] = L_emission;
+    aov->lobes[(int)lobe] = L_out - L_emission;
+  }
   return L_out;
 }
 } // namespace verdant
@@ -1,16 +1,18 @@
 #pragma once
+#include "Aov.h"
 #include "Scene.h"
 
 namespace verdant {
 // Implements the classical Kajiya path-tracing
 class PathTracer {
 public:
-  PathTracer(const Scene &scene, UniformSampler &sampler);
+  PathTracer(const Scene &scene, Sampler &sampler);
 
-  float3 radiance(const Ray &in_ray);
+  // Fills aov as well when it is not null
+  float3 radiance(const Ray &in_ray, AovSample *aov = nullptr);
 
 private:
   const Scene &scene;
-  UniformSampler &sampler;
+  Sampler &sampler;
 };
 } // namespace verdant
@@ -2,11 +2,34 @@
 #include "PathTracer.h"
 #include "Sampler.h"
 #include "TaskQueue.h"
+#include "Trace.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
 #include <memory>
 #include <stdio.h>
 #include <thread>
 #include <vector>
 
+namespace {
+const unsigned int tile_len = 256;
+
+// Binds tiles to NUMA nodes in horizontal bands of the film, so that the
+// workers of a node keep to their own rows
+unsigned int tile_node(unsigned int y, unsigned int height) {
+  unsigned int node_count =
+      verdant::TaskQueue::default_queue().get_node_count();
+  unsigned int tile_rows = (height + tile_len - 1) / tile_len;
+  return y / tile_len * node_count / tile_rows;
+}
+
+int64_t steady_nanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+} // namespace
+
 namespace verdant {
 PathTracePipeline::PathTracePipeline(unsigned int width, unsigned int height,
                                      unsigned int samples)
@@ -20,46 +43,196 @@ PathTracePipeline::PathTracePipeline(unsigned int width, unsigned int height,
 }
 
 void PathTracePipeline::run(const std::string &file_name, bool write) {
-  const unsigned int tile_len = 256;
+  // The coroutine continues on its own
+  run_async(file_name, write);
+}
 
+Async<> PathTracePipeline::run_async(std::string file_name, bool write) {
   // Cannot call run when it is already running
-  if (is_running) {
+  if (is_running.exchange(true)) {
+    co_return;
+  }
+
+  // Tokens stay cancelled, so every run gets a new one
+  cancel_token = CancellationToken::create();
+  tiles_total = 0;
+  tiles_completed = 0;
+  completed_samples = 0;
+  checkpoint_due = steady_nanoseconds() + (int64_t)(checkpoint_interval * 1e9);
+
+  if (progressive) {
+    auto run_start = std::chrono::steady_clock::now();
+    // Resumed films skip the passes they completed
+    unsigned int prev_target = film->get_min_sample_count();
+    unsigned int target = std::min(
+        prev_target ? std::bit_floor(prev_target) * 2 : 1u, samples);
+    while (true) {
+      auto pass_start = std::chrono::steady_clock::now();
+      uint64_t trace_start = Trace::now();
+      co_await when_all(enqueue_pass(target), priority);
+      // Begins and ends on different threads
+      Trace::complete("pass", trace_start, "samples", target);
+
+      // Publish the pass
+      if (!cancel_token.is_cancelled()) {
+        completed_samples = target;
+        if (write) {
+          write_film(file_name);
+        }
+        if (event_callback)
+          event_callback(user_data, EventType::PassCompleted);
+      }
+
+      unsigned int next_target = std::min(target * 2, samples);
+      bool done =
+          cancel_token.is_cancelled() || target >= samples || !pass_active;
+      if (!done && time_budget > 0.0) {
+        // Predict the next pass from the cost per sample of this one
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> pass_time = now - pass_start;
+        std::chrono::duration<double> run_time = now - run_start;
+        double next_time = pass_time.count() * (next_target - target) /
+                           (target - prev_target);
+        done = run_time.count() + next_time > time_budget;
+      }
+      if (done) {
+        break;
+      }
+      prev_target = target;
+      target = next_target;
+    }
+  } else {
+    uint64_t trace_start = Trace::now();
+    unsigned int y, x;
+    std::vector<TaskHandle> tasks;
+    for (y = 0; y < film->get_height(); y += tile_len) {
+      for (x = 0; x < film->get_width(); x += tile_len) {
+        tiles_total += 1;
+        tasks.push_back(TaskQueue::default_queue().enqueue_on_node(
+            tile_node(y, film->get_height()),
+            [this, x, y]() { render_tile(x, y, tile_len, tile_len); },
+            {priority, cancel_token}));
+      }
+    }
+    co_await when_all(std::move(tasks), priority);
+    Trace::complete("render", trace_start, "samples", samples);
+
+    if (write) {
+      write_film(file_name);
+    }
+  }
+
+  if (!checkpoint_name.empty()) {
+    write_checkpoint();
+  }
+
+  is_running = false;
+  if (event_callback)
+    event_callback(user_data, EventType::NoLongerRunning);
+}
+
+void PathTracePipeline::set_denoise(bool enabled,
+                                    const DenoiserSettings &settings) {
+  denoise = enabled;
+  denoiser = Denoiser(settings);
+  if (enabled) {
+    AovSettings aovs = film->get_aovs();
+    if (!aovs.albedo || !aovs.normal) {
+      aovs.albedo = true;
+      aovs.normal = true;
+      film->set_aovs(aovs);
+    }
+  }
+}
+
+bool PathTracePipeline::resume(const std::string &file_name) {
+  CheckpointSettings settings;
+  if (!Checkpoint::read(file_name, settings, *film)) {
+    return false;
+  }
+  sampler_kind = settings.sampler_kind;
+  seed = settings.seed;
+  film->set_filter(Filter(settings.filter_kind, settings.filter_radius));
+  return true;
+}
+
+void PathTracePipeline::checkpoint_if_due() {
+  if (checkpoint_name.empty()) {
+    return;
+  }
+  int64_t now = steady_nanoseconds();
+  int64_t due = checkpoint_due;
+  int64_t next = now + (int64_t)(checkpoint_interval * 1e9);
+  // Only the thread that moves the time forward writes
+  if (now < due || !checkpoint_due.compare_exchange_strong(due, next)) {
     return;
   }
+  write_checkpoint();
+}
+
+void PathTracePipeline::write_checkpoint() {
+  CheckpointSettings settings;
+  settings.sampler_kind = sampler_kind;
+  settings.seed = seed;
+  settings.filter_kind = film->get_filter().get_kind();
+  settings.filter_radius = film->get_filter().get_radius();
+
+  // Writers take turns, so that an older state never replaces a newer one.
+  // Tiles only wait for the copy of the film, not for the disk
+  std::unique_lock write_lock(checkpoint_mutex);
+  {
+    std::unique_lock lock(merge_mutex);
+    Checkpoint::encode(settings, *film, checkpoint_bytes);
+  }
+  if (!Checkpoint::write(checkpoint_name, checkpoint_bytes)) {
+    fprintf(stderr, "Could not write checkpoint %s\n",
+            checkpoint_name.c_str());
+  }
+}
 
-  is_running = true;
-  stop_flag = false;
+void PathTracePipeline::write_film(const std::string &file_name) {
+  if (!denoise) {
+    film->write(file_name);
+    return;
+  }
+  if (!denoised_film) {
+    denoised_film =
+        std::make_shared<Film>(film->get_width(), film->get_height());
+  }
+  denoised_film->set_tone_mapper(film->get_tone_mapper());
+  denoiser.run(*film, *denoised_film);
+  denoised_film->write(file_name);
+}
+
+std::vector<TaskHandle> PathTracePipeline::enqueue_pass(unsigned int target) {
   tiles_total = 0;
   tiles_completed = 0;
+  pass_active = false;
 
   unsigned int y, x;
-  std::vector<const Task *> tasks;
+  std::vector<TaskHandle> tasks;
   for (y = 0; y < film->get_height(); y += tile_len) {
     for (x = 0; x < film->get_width(); x += tile_len) {
       tiles_total += 1;
-      tasks.push_back(TaskQueue::default_queue().enqueue(
-          [this, x, y, tile_len]() { render_tile(x, y, tile_len, tile_len); }));
-    }
-  }
-
-  TaskQueue::default_queue().enqueue_await_all(
-      [this]() {
-        is_running = false;
+      auto tile = [this, x, y, target]() {
+        if (render_tile_pass(x, y, tile_len, tile_len, target)) {
+          pass_active = true;
+        }
+        tiles_completed.fetch_add(1);
         if (event_callback)
-          event_callback(user_data, EventType::NoLongerRunning);
-      },
-      tasks);
-
-  if (write) {
-    TaskQueue::default_queue().enqueue_await_all(
-        [this, file_name]() { film->write_to_ppm(file_name); }, tasks);
+          event_callback(user_data, EventType::TileCompleted);
+      };
+      tasks.push_back(TaskQueue::default_queue().enqueue_on_node(
+          tile_node(y, film->get_height()), tile, {priority, cancel_token}));
+    }
   }
+  return tasks;
 }
 
-void PathTracePipeline::stop() { stop_flag = true; }
+void PathTracePipeline::stop() { cancel_token.cancel(); }
 
 void PathTracePipeline::single_pixel(unsigned int x, unsigned int y) {
-  PathTracer integrator(*scene, UniformSampler::per_thread());
+  PathTracer integrator(*scene, Sampler::per_thread());
 
   Ray ray = camera->generate_ray_from_uv(film->xy_to_uv(x, y));
   ray.origin.z() += 5.0f;
@@ -76,26 +249,87 @@ void PathTracePipeline::get_status(bool &is_running, int &tiles_total,
 
 void PathTracePipeline::render_tile(unsigned int x_begin, unsigned int y_begin,
                                     unsigned int x_len, unsigned int y_len) {
-  PathTracer integrator(*scene, UniformSampler::per_thread());
-  unsigned int x, y;
-  for (y = y_begin; y < y_begin + y_len && y < film->get_height(); y++) {
-    for (x = x_begin; x < x_begin + x_len && x < film->get_width(); x++) {
-      unsigned int t;
-      Ray ray = camera->generate_ray_from_uv(film->xy_to_uv(x, y));
-      ray.origin.z() += 5.0f;
-      for (t = 0; t < samples; t++) {
-        float3 Li = integrator.radiance(ray);
-        film->average_radiance(x, y, Li);
-
-        if (stop_flag) {
-          return;
-        }
-      }
+  if (noise_threshold > 0.0f) {
+    // Every pixel first gets min_samples, then each round doubles the sample
+    // count of the pixels that have not converged yet
+    unsigned int target = std::min(min_samples, samples);
+    while (render_tile_pass(x_begin, y_begin, x_len, y_len, target) &&
+           target < samples) {
+      target = std::min(target * 2, samples);
     }
+  } else {
+    render_tile_pass(x_begin, y_begin, x_len, y_len, samples);
   }
 
+  if (cancel_token.is_cancelled()) {
+    return;
+  }
   tiles_completed.fetch_add(1);
   if (event_callback)
     event_callback(user_data, EventType::TileCompleted);
 }
-} // namespace verdant
\ No newline at end of file
+
+bool PathTracePipeline::render_tile_pass(unsigned int x_begin,
+                                         unsigned int y_begin,
+                                         unsigned int x_len, unsigned int y_len,
+                                         unsigned int target) {
+  TraceScope scope("tile", "x", x_begin, "y", y_begin);
+  Sampler sampler(sampler_kind, seed);
+  PathTracer integrator(*scene, sampler);
+  unsigned int x_end = std::min(x_begin + x_len, film->get_width());
+  unsigned int y_end = std::min(y_begin + y_len, film->get_height());
+  bool adaptive = noise_threshold > 0.0f;
+  const Filter &filter = film->get_filter();
+
+  // Kept per thread, so its storage is reused by the following tiles
+  thread_local FilmTile tile;
+  tile.reset(x_begin, y_begin, x_end - x_begin, y_end - y_begin,
+             film->get_aovs());
+  AovSample aov;
+  AovSample *aov_out = film->get_aovs().any() ? &aov : nullptr;
+
+  bool any_active = false;
+  unsigned int x, y;
+  for (y = y_begin; y < y_end; y++) {
+    for (x = x_begin; x < x_end; x++) {
+      unsigned int n = film->get_sample_count(x, y);
+      if (n >= target) {
+        continue;
+      }
+      if (adaptive && n >= min_samples &&
+          film->get_relative_error(x, y) < noise_threshold) {
+        continue;
+      }
+
+      any_active = true;
+      for (; n < target; n++) {
+        sampler.start_pixel_sample({x, y}, n);
+        // The first two dimensions place the sample within the filter
+        // footprint around the pixel center, which antialiases edges
+        auto [u0_pdf, u0] = sampler.sample();
+        auto [u1_pdf, u1] = sampler.sample();
+        auto [offset, weight] = filter.sample(u0, u1);
+        float2 position(x + 0.5f + offset.x(), y + 0.5f + offset.y());
+        Ray ray = camera->generate_ray_from_uv(film->xy_to_uv(position));
+        ray.origin.z() += 5.0f;
+
+        float3 Li = integrator.radiance(ray, aov_out);
+        tile.add_sample(x, y, Li, weight, aov_out);
+
+        if (cancel_token.is_cancelled()) {
+          // Keep the samples taken so far
+          std::shared_lock lock(merge_mutex);
+          film->merge_tile(tile);
+          return false;
+        }
+      }
+    }
+  }
+  {
+    std::shared_lock lock(merge_mutex);
+    film->merge_tile(tile);
+  }
+  checkpoint_if_due();
+  return any_active;
+}
+} // namespace verdant
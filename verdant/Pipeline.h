@@ -1,12 +1,22 @@
 #pragma once
+#include "Async.h"
 #include "Camera.h"
+#include "Checkpoint.h"
+#include "Denoiser.h"
 #include "Film.h"
+#include "Sampler.h"
 #include "Scene.h"
+#include "Task.h"
 #include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
 
 namespace verdant {
-enum class EventType { TileCompleted, NoLongerRunning };
+enum class EventType { TileCompleted, PassCompleted, NoLongerRunning };
 
 typedef void (*EventCallback)(void *user_data, EventType event_type);
 
@@ -20,11 +30,97 @@ public:
   std::shared_ptr<Film> get_film() const { return film; }
 
   // Both run and stop are async. Use event_callback to listen to events.
+  // stop drops the tiles that have not started yet, and running tiles return
+  // after their current sample. Call both from the same thread
   void run(const std::string &file_name, bool write = true);
   void stop();
 
+  // Same as run, and finishes once rendering finished and the film was
+  // written, so it can be awaited by other coroutines
+  Async<> run_async(std::string file_name, bool write = true);
+
   void single_pixel(unsigned int x, unsigned int y);
 
+  /**
+   * @brief Switches to adaptive sampling, where samples becomes the maximum
+   * per pixel. Pixels are sampled in rounds and stop once their relative
+   * error falls below noise_threshold. A threshold of 0 disables it
+   *
+   * @param noise_threshold Target relative standard error, see Film
+   * @param min_samples Samples taken before the error estimate is trusted
+   */
+  void set_adaptive_sampling(float noise_threshold,
+                             unsigned int min_samples = 16) {
+    this->noise_threshold = noise_threshold;
+    this->min_samples = min_samples;
+  }
+
+  /**
+   * @brief Switches run to progressive rendering. All tiles are rendered to
+   * 1 sample per pixel, then 2, 4 and so on up to samples. The film is
+   * written and PassCompleted is sent after every pass
+   *
+   * @param enabled Whether to render progressively
+   * @param time_budget Wall clock seconds, or 0 for no limit. No pass is
+   * started that is predicted to end past the budget
+   */
+  void set_progressive(bool enabled, double time_budget = 0.0) {
+    progressive = enabled;
+    this->time_budget = time_budget;
+  }
+
+  // Source of sample values for the integrator, independent uniform random
+  // numbers by default
+  void set_sampler(SamplerKind kind) { sampler_kind = kind; }
+
+  // Renders with the same seed are reproducible. Change it per frame of an
+  // animation to decorrelate the noise between frames
+  void set_seed(unsigned int value) { seed = value; }
+
+  // Priority of the tasks of later runs, so that an interactive preview can
+  // go ahead of a background render sharing the workers
+  void set_priority(TaskPriority value) { priority = value; }
+
+  /**
+   * @brief Filters the noise of the film before every write, including
+   * those after progressive passes. Enables the albedo and normal outputs
+   * of the film as guides. The film itself keeps the unfiltered samples
+   *
+   * @param enabled Whether to denoise
+   * @param settings Strength of the filter
+   */
+  void set_denoise(bool enabled, const DenoiserSettings &settings = {});
+
+  // Output of the last denoised write, or null before one
+  std::shared_ptr<Film> get_denoised_film() const { return denoised_film; }
+
+  /**
+   * @brief Saves the progress of runs to a checkpoint file, once interval
+   * seconds passed since the last one and a tile finished, and when a run
+   * ends or is stopped. An empty file name disables checkpoints
+   *
+   * @param file_name Checkpoint to write, replaced every time
+   * @param interval Minimum wall clock seconds between checkpoints
+   */
+  void set_checkpoint(const std::string &file_name, double interval = 300.0) {
+    checkpoint_name = file_name;
+    checkpoint_interval = interval;
+  }
+
+  /**
+   * @brief Continues from a checkpoint. Loads its film and the sampler,
+   * seed and filter it was rendered with, so that the next run only takes
+   * the samples each pixel is missing, the same ones as if the render had
+   * never stopped. Raising samples refines a finished render
+   *
+   * @return bool false if the file could not be read or its film does not
+   * have the size and output variables of this one
+   */
+  bool resume(const std::string &file_name);
+
+  // Samples per pixel of the last completed progressive pass
+  unsigned int get_completed_samples() const { return completed_samples; }
+
   void set_event_callback(EventCallback fn, void *data) {
     event_callback = fn;
     user_data = data;
@@ -37,16 +133,56 @@ protected:
   void render_tile(unsigned int x, unsigned int y, unsigned int x_len,
                    unsigned int y_len);
 
+  // Samples each pixel of the tile until it has target samples, skipping
+  // converged pixels in adaptive mode. Returns whether any pixel was sampled
+  bool render_tile_pass(unsigned int x, unsigned int y, unsigned int x_len,
+                        unsigned int y_len, unsigned int target);
+
+  // Starts one progressive pass over all tiles, bringing pixels up to target
+  std::vector<TaskHandle> enqueue_pass(unsigned int target);
+
+  // Writes the film, denoised first when enabled
+  void write_film(const std::string &file_name);
+
+  // Writes a checkpoint if one is due, called after merging tiles
+  void checkpoint_if_due();
+  void write_checkpoint();
+
 private:
   unsigned int samples;
+  float noise_threshold = 0.0f;
+  unsigned int min_samples = 16;
+  bool progressive = false;
+  double time_budget = 0.0;
+  SamplerKind sampler_kind = SamplerKind::Uniform;
+  unsigned int seed = 0;
+  TaskPriority priority = TaskPriority::Normal;
   std::shared_ptr<Scene> scene;
   std::shared_ptr<Camera> camera;
   std::shared_ptr<Film> film;
+  bool denoise = false;
+  Denoiser denoiser;
+  std::shared_ptr<Film> denoised_film;
+
+  std::string checkpoint_name;
+  double checkpoint_interval = 300.0;
+  // steady_clock time of the next checkpoint, in nanoseconds
+  std::atomic<int64_t> checkpoint_due = 0;
+  // Held shared while merging tiles and exclusive while a checkpoint copies
+  // the film, so that checkpoints do not see a tile half merged
+  std::shared_mutex merge_mutex;
+  // Held while writing a checkpoint, and guards the reused buffer it is
+  // encoded into
+  std::mutex checkpoint_mutex;
+  std::vector<unsigned char> checkpoint_bytes;
 
-  bool is_running = false;
-  bool stop_flag;
+  std::atomic_bool is_running = false;
+  // Cancelled by stop
+  CancellationToken cancel_token;
   int tiles_total;
   std::atomic_int tiles_completed;
+  std::atomic_bool pass_active;
+  std::atomic_uint completed_samples = 0;
 
   EventCallback event_callback = nullptr;
   void *user_data;
@@ -0,0 +1,46 @@
+#pragma once
+#include "MathDefs.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+
+namespace verdant {
+// Shared exponent RGB as in EXT_texture_shared_exponent: three 9 bit
+// mantissas and one 5 bit exponent in 32 bits. Every channel has the
+// precision of the brightest one, enough for radiance and a third of float3
+const float rgb9e5_max = 65408.0f;
+
+// Negative values and NaN become 0, values above rgb9e5_max saturate
+inline uint32_t float3_to_rgb9e5(float3 value) {
+  float c[3];
+  for (int i = 0; i < 3; i++) {
+    // Also clamps NaN, which fails both comparisons
+    c[i] = value[i] > 0.0f ? std::min(value[i], rgb9e5_max) : 0.0f;
+  }
+  float max_c = std::max(c[0], std::max(c[1], c[2]));
+  // Exponent of the brightest channel from its float bits, biased by 15 and
+  // raised by 1 so that it fits in 9 bits with the leading one
+  int exponent =
+      std::max((int)(std::bit_cast<uint32_t>(max_c) >> 23) - 127, -16) + 16;
+  auto scale = [](int e) {
+    // 2^(24 - e), the inverse of the step of the mantissas
+    return std::bit_cast<float>((uint32_t)(24 - e + 127) << 23);
+  };
+  // Rounding up may carry into a tenth bit
+  if ((uint32_t)(max_c * scale(exponent) + 0.5f) == 512) {
+    exponent++;
+  }
+  uint32_t bits = (uint32_t)exponent << 27;
+  for (int i = 0; i < 3; i++) {
+    bits |= (uint32_t)(c[i] * scale(exponent) + 0.5f) << (9 * i);
+  }
+  return bits;
+}
+
+inline float3 rgb9e5_to_float3(uint32_t bits) {
+  // 2^(exponent - 15 - 9)
+  float scale = std::bit_cast<float>(((bits >> 27) + 103) << 23);
+  return {(bits & 0x1ff) * scale, ((bits >> 9) & 0x1ff) * scale,
+          ((bits >> 18) & 0x1ff) * scale};
+}
+} // namespace verdant
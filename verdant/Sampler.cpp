@@ -1,20 +1,107 @@
 #include "Sampler.h"
-#include <mutex>
-#include <random>
+#include <array>
+#include <cstdint>
 
 namespace {
-std::mutex rd_mutex;
-std::random_device rd;
-thread_local verdant::UniformSampler uniform_sampler_per_thread;
+thread_local verdant::Sampler sampler_per_thread;
+
+const float ONE_MINUS_EPSILON = 0x1.fffffep-1f;
+
+// Generates direction numbers for one Sobol dimension from its primitive
+// polynomial, given by degree s, coefficients a and initial numbers m
+constexpr std::array<uint32_t, 32>
+sobol_directions(int s, uint32_t a, std::array<uint32_t, 3> m) {
+  std::array<uint32_t, 32> v{};
+  if (s == 0) {
+    // The first dimension is the van der Corput sequence
+    for (int i = 0; i < 32; i++) {
+      v[i] = 1u << (31 - i);
+    }
+    return v;
+  }
+  for (int i = 0; i < s; i++) {
+    v[i] = m[i] << (31 - i);
+  }
+  for (int i = s; i < 32; i++) {
+    v[i] = v[i - s] ^ (v[i - s] >> s);
+    for (int k = 1; k < s; k++) {
+      v[i] ^= ((a >> (s - 1 - k)) & 1) * v[i - k];
+    }
+  }
+  return v;
+}
+
+// The first four dimensions of Joe and Kuo's new-joe-kuo-6.21201
+constexpr std::array<std::array<uint32_t, 32>, 4> sobol_matrices = {
+    sobol_directions(0, 0, {}),
+    sobol_directions(1, 0, {1}),
+    sobol_directions(2, 1, {1, 3}),
+    sobol_directions(3, 1, {1, 3, 1}),
+};
+
+uint32_t sobol(uint32_t index, int dim) {
+  uint32_t x = 0;
+  for (int bit = 0; index != 0; bit++, index >>= 1) {
+    if (index & 1) {
+      x ^= sobol_matrices[dim][bit];
+    }
+  }
+  return x;
+}
+
+uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Hash based nested uniform (Owen) scrambling in base 2
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+uint32_t hash_combine(uint32_t seed, uint32_t v) {
+  seed ^= v + 0x9e3779b9u + (seed << 6) + (seed >> 2);
+  // Murmur3 finalizer to spread all bits
+  seed ^= seed >> 16;
+  seed *= 0x85ebca6bu;
+  seed ^= seed >> 13;
+  seed *= 0xc2b2ae35u;
+  seed ^= seed >> 16;
+  return seed;
+}
 } // namespace
 
 namespace verdant {
-UniformSampler::UniformSampler() {
-  std::unique_lock<std::mutex> lk(rd_mutex);
-  random_engine = std::mt19937(rd());
+void Sampler::start_pixel_sample(uint2 pixel, unsigned int sample_index) {
+  pixel_hash = hash_combine(hash_combine(seed, pixel.x()), pixel.y());
+  this->sample_index = sample_index;
+  dimension = 0;
+  if (kind == SamplerKind::Uniform) {
+    uniform.set_seed(pixel_hash, sample_index);
+  }
 }
 
-UniformSampler &UniformSampler::per_thread() {
-  return uniform_sampler_per_thread;
+float Sampler::sample_sobol() {
+  unsigned int group_seed = hash_combine(pixel_hash, dimension / 4);
+  int dim = dimension % 4;
+  dimension++;
+
+  // Shuffle the points within the pixel, consistently across the group so
+  // that the dimensions of a group stay stratified against each other
+  uint32_t index = nested_uniform_scramble(sample_index, group_seed);
+  uint32_t x = sobol(index, dim);
+  x = nested_uniform_scramble(x, hash_combine(group_seed, dim));
+  return std::min(x * 0x1p-32f, ONE_MINUS_EPSILON);
 }
+
+Sampler &Sampler::per_thread() { return sampler_per_thread; }
 } // namespace verdant
@@ -1,30 +1,99 @@
 #pragma once
 #include "MathDefs.h"
-#include <random>
+#include <cstdint>
 #include <tuple>
 
 namespace verdant {
+// Independent uniform random numbers from O'Neill's PCG32 generator. The state
+// is only 16 bytes, so one can be seeded for every pixel sample
 class UniformSampler {
 public:
-  UniformSampler();
+  UniformSampler()
+      : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
+  explicit UniformSampler(uint64_t seed, uint64_t stream = 0) {
+    set_seed(seed, stream);
+  }
+
+  // Different streams give independent sequences for the same seed
+  void set_seed(uint64_t seed, uint64_t stream = 0) {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next_uint();
+    state += seed;
+    next_uint();
+  }
+
+  uint32_t next_uint() {
+    uint64_t old_state = state;
+    state = old_state * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = ((old_state >> 18) ^ old_state) >> 27;
+    uint32_t rot = old_state >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // Uniform in [0, 1) with 24 bits of precision
+  float next_float() { return (next_uint() >> 8) * 0x1p-24f; }
+
+  std::tuple<float, float> sample() { return {pdf(), next_float()}; }
+
+  float pdf() const { return 1.0f; }
+
+private:
+  uint64_t state;
+  uint64_t inc;
+};
+
+enum class SamplerKind { Uniform, Sobol };
+
+// Supplies the sample values of one path at a time, addressed by pixel,
+// sample index and dimension. Each call to sample returns the next dimension.
+// Like Surface, this is a discriminated union instead of a virtual base
+class Sampler {
+public:
+  explicit Sampler(SamplerKind kind = SamplerKind::Uniform,
+                   unsigned int seed = 0)
+      : kind(kind), seed(seed) {}
+
+  SamplerKind get_kind() const { return kind; }
+
+  // Starts the path with the given sample index in a pixel, rewinding to the
+  // first dimension. The values of a path only depend on the pixel, the
+  // sample index and the seed, which makes renders reproducible
+  void start_pixel_sample(uint2 pixel, unsigned int sample_index);
 
   std::tuple<float, float> sample() {
-    std::uniform_real_distribution<float> dist(0, 1);
-    return {pdf(), dist(random_engine)};
+    switch (kind) {
+    case SamplerKind::Uniform:
+      return uniform.sample();
+    case SamplerKind::Sobol:
+      return {pdf(), sample_sobol()};
+    }
+    return {pdf(), 0.0f};
   }
 
   float pdf() const { return 1.0f; }
 
-  static UniformSampler &per_thread();
+  static Sampler &per_thread();
+
+protected:
+  // Owen scrambled Sobol points, shuffled and padded in groups of 4
+  // dimensions as in Burley's "Practical Hash-based Owen Scrambling"
+  float sample_sobol();
 
 private:
-  std::mt19937 random_engine;
+  SamplerKind kind;
+  unsigned int seed;
+  UniformSampler uniform;
+
+  unsigned int pixel_hash = 0;
+  unsigned int sample_index = 0;
+  unsigned int dimension = 0;
 };
 
 class UniformHemisphereDistribution {
 public:
   // Returns the pdf and the unit vector representing the direction
-  std::tuple<float, float3> sample(UniformSampler &base_sampler) const {
+  std::tuple<float, float3> sample(Sampler &base_sampler) const {
     auto [u0_pdf, u0] = base_sampler.sample();
     auto [u1_pdf, u1] = base_sampler.sample();
 
@@ -45,7 +114,7 @@ public:
 class CosineWeightedHemisphereDistribution {
 public:
   // Returns the pdf and the unit vector representing the direction
-  std::tuple<float, float3> sample(UniformSampler &base_sampler) const {
+  std::tuple<float, float3> sample(Sampler &base_sampler) const {
     auto [u0_pdf, u0] = base_sampler.sample();
     auto [u1_pdf, u1] = base_sampler.sample();
 
@@ -67,7 +136,7 @@ public:
 };
 
 // Takes the value 1 with probability p and value 0 with probability 1-p
-inline int bernoulli_toss(UniformSampler &sampler, float p) {
+inline int bernoulli_toss(Sampler &sampler, float p) {
   auto [pdf, x] = sampler.sample();
   if (x < p) {
     return 1;
@@ -17,7 +17,7 @@ int main() {
   const int N = 10000;
   const int ITERS = 100;
   float result = 0.0f;
-  verdant::UniformSampler base;
+  verdant::Sampler base;
   for (int i = 0; i < ITERS; i++) {
     verdant::CosineWeightedHemisphereDistribution dist;
     float batch_result = integrate_one(dist, base, N);
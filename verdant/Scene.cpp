@@ -1,7 +1,10 @@
 #include "Scene.h"
+#include "FastTrig.h"
 #include "MathDefs.h"
 #include "Shape.h"
 #include "Surface.h"
+#include "TaskQueue.h"
+#include "Trace.h"
 #include <cmath>
 #include <cstdio>
 #include <limits>
@@ -16,10 +19,54 @@ bool Primitive::intersect(const Ray &ray, Intersection &isect) const {
   bool hit = shape->intersect(ray, isect);
   if (hit) {
     isect.material = material;
+    isect.primitive = this;
   }
   return hit;
 }
 
+float3 AreaLight::sample_Li(const float3 &p, float u0, float u1, float3 &wi,
+                            float &dist, float &pdf) const {
+  float3 q, n;
+  primitive->get_shape().sample_area(u0, u1, q, n);
+  wi = q - p;
+  float dist2 = wi.squared_length();
+  if (dist2 == 0.0f) {
+    pdf = 0.0f;
+    return float3::ZERO;
+  }
+  dist = sqrtf(dist2);
+  wi /= dist;
+
+  pdf = pdf_Li(wi, dist, n);
+  if (pdf == 0.0f) {
+    return float3::ZERO;
+  }
+  return primitive->get_material()->Le(n, -wi);
+}
+
+float AreaLight::pdf_Li(const float3 &wi, float dist, const float3 &n) const {
+  // Convert the area density to solid angle
+  float cos_theta = std::abs(dot(n, wi));
+  if (cos_theta == 0.0f) {
+    return 0.0f;
+  }
+  return dist * dist / (cos_theta * primitive->get_shape().get_area());
+}
+
+LightBounds AreaLight::get_light_bounds() const {
+  const Shape &shape = primitive->get_shape();
+  float3 Le = primitive->get_material()->get_emission();
+
+  LightBounds lb;
+  lb.bounds = shape.get_bounds();
+  shape.get_normal_cone(lb.w, lb.cos_theta_o);
+  // Diffuse emission from the front face only
+  lb.phi = (Le.x() + Le.y() + Le.z()) / 3 * shape.get_area() * M_PI;
+  lb.cos_theta_e = 0.0f;
+  lb.two_sided = false;
+  return lb;
+}
+
 Scene::Scene() {
   set_sky_light(true, float3::ONE);
   std::shared_ptr<Surface> furnace_material =
@@ -77,27 +124,113 @@ Scene::Scene() {
   }
 }
 
+void Scene::build_bvh() {
+  TraceScope scope("BVH build");
+  std::vector<Primitive *> prefs;
+  area_lights.clear();
+  for (auto &prim : primitives) {
+    prefs.push_back(&prim);
+    // Shapes without area, such as lines, cannot be sampled as lights
+    if (prim.get_material()->is_emissive() &&
+        prim.get_shape().get_area() > 0.0f) {
+      prim.set_light_index(area_lights.size());
+      area_lights.emplace_back(&prim);
+    } else {
+      prim.set_light_index(-1);
+    }
+  }
+  bvh = BVH(prefs);
+
+  // Each replica is copied from bvh by a worker of its node, on that worker
+  // alone, so that first touch puts all of its nodes in local memory. Nodes
+  // without workers never look one up
+  bvh_replicas.clear();
+  TaskQueue &queue = TaskQueue::default_queue();
+  unsigned int node_count = queue.get_node_count();
+  if (node_count > 1) {
+    bvh_replicas.resize(node_count);
+    std::vector<TaskHandle> tasks;
+    for (unsigned int node = 0; node < node_count; node++) {
+      if (queue.get_node_stats(node).workers == 0) {
+        continue;
+      }
+      tasks.push_back(queue.enqueue_on_node(
+          node, [this, node]() { bvh_replicas[node] = bvh; }, {}, true));
+    }
+    for (const TaskHandle &task : tasks) {
+      queue.wait(task);
+    }
+  }
+
+  std::vector<LightBounds> light_bounds;
+  for (const AreaLight &light : area_lights) {
+    light_bounds.push_back(light.get_light_bounds());
+  }
+  light_bvh = LightBVH(light_bounds);
+}
+
+Async<> Scene::build_bvh_async() {
+  co_await resume_on_worker();
+  build_bvh();
+}
+
 bool Scene::intersect(const Ray &ray, Intersection &isect) const {
   // printf("(%.3f, %.3f, %.3f) (%.3f, %.3f, %.3f)\n", world_ray.origin.x(),
   //        world_ray.origin.y(), world_ray.origin.z(), world_ray.dir.x(),
   //        world_ray.dir.y(), world_ray.dir.z());
 
   isect.t = std::numeric_limits<float>::infinity();
+  unsigned int node = TaskQueue::current_node();
+  if (node < bvh_replicas.size() && !bvh_replicas[node].empty()) {
+    return bvh_replicas[node].intersect(ray, isect);
+  }
   return bvh.intersect(ray, isect);
 }
 
-float3 Scene::get_sky_light(const float3 &world_dir) const {
+bool Scene::sample_area_light(const float3 &p, const float3 &n,
+                              Sampler &sampler, LightSample &ls) const {
+  auto [u_pdf, u] = sampler.sample();
+  auto [u0_pdf, u0] = sampler.sample();
+  auto [u1_pdf, u1] = sampler.sample();
+
+  unsigned int light_index;
+  float pmf;
+  if (!light_bvh.sample(p, n, u, light_index, pmf)) {
+    return false;
+  }
+
+  const AreaLight &light = area_lights[light_index];
+  ls.Le = light.sample_Li(p, u0, u1, ls.wi, ls.dist, ls.pdf);
+  ls.pdf *= pmf;
+  ls.primitive = light.get_primitive();
+  return ls.pdf > 0.0f;
+}
+
+float Scene::area_light_pdf(const float3 &p, const float3 &n, const Ray &ray,
+                            const Intersection &isect) const {
+  int light_index = isect.primitive->get_light_index();
+  if (light_index < 0) {
+    return 0.0f;
+  }
+  float pmf = light_bvh.pmf(p, n, light_index);
+  return pmf * area_lights[light_index].pdf_Li(ray.dir, isect.t,
+                                               isect.geometric_normal);
+}
+
+float3 Scene::get_sky_light(const float3 &world_dir, float footprint) const {
+  if (!sky_light_hdr_image) {
+    return sky_light_value;
+  }
   // phi in [0, 2*pi]
   // When phi==pi, x is 1 and z is 0
-  float phi = atan2f(world_dir.z(), world_dir.x());
+  float phi = fast_atan2(world_dir.z(), world_dir.x());
   phi += M_PI;
   // theta in [0, pi]
-  float theta = acosf(world_dir.y());
+  float theta = fast_acos(world_dir.y());
 
-  if (sky_light_hdr_image) {
-    return sky_light_hdr_image->get_color_spherical(theta, phi);
+  if (footprint > 0.0f) {
+    return sky_light_hdr_image->get_color_spherical(theta, phi, footprint);
   }
-
-  return sky_light_value;
+  return sky_light_hdr_image->get_color_spherical(theta, phi);
 }
 } // namespace verdant
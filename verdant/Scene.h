@@ -1,9 +1,13 @@
 #pragma once
+#include "Async.h"
 #include "BVH.h"
 #include "HDRImage.h"
+#include "LightBVH.h"
 #include "MathDefs.h"
+#include "Sampler.h"
 #include "Shape.h"
 #include "Surface.h"
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -14,9 +18,17 @@ public:
   bool intersect(const Ray &ray, Intersection &isect) const;
   BBox3 get_bounds() const { return shape->get_bounds(); }
 
+  const Shape &get_shape() const { return *shape; }
+  const std::shared_ptr<Surface> &get_material() const { return material; }
+
+  // Index into the scene's area lights, or -1 if this does not emit
+  int get_light_index() const { return light_index; }
+  void set_light_index(int value) { light_index = value; }
+
 private:
   std::shared_ptr<Shape> shape;
   std::shared_ptr<Surface> material;
+  int light_index = -1;
 };
 
 class PointLight {
@@ -32,20 +44,77 @@ private:
   float3 irradiance;
 };
 
+// A diffuse emitter backed by an emissive primitive
+class AreaLight {
+public:
+  AreaLight(const Primitive *primitive) : primitive(primitive) {}
+
+  const Primitive *get_primitive() const { return primitive; }
+
+  // Samples a point on the light uniformly by area, and returns the direction
+  // wi and distance from p to it, and the solid angle density of that
+  // direction. Returns the radiance arriving at p ignoring occlusion
+  float3 sample_Li(const float3 &p, float u0, float u1, float3 &wi,
+                   float &dist, float &pdf) const;
+
+  // Solid angle density of sample_Li choosing the point at distance dist along
+  // wi, where the light has surface normal n
+  float pdf_Li(const float3 &wi, float dist, const float3 &n) const;
+
+  LightBounds get_light_bounds() const;
+
+private:
+  const Primitive *primitive;
+};
+
+// A point sampled on an area light, as seen from a shading point
+struct LightSample {
+  float3 Le;
+  float3 wi;
+  float dist;
+  // Solid angle density, including the probability of choosing the light
+  float pdf;
+  const Primitive *primitive;
+};
+
 class Scene {
 public:
   Scene();
 
-  void build_bvh() {
-    std::vector<Primitive *> prefs;
-    for (auto &prim : primitives) {
-      prefs.push_back(&prim);
-    }
-    bvh = BVH(std::move(prefs));
+  // Must be called after changing primitives and before rendering. Also
+  // collects emissive primitives into the area light list. When workers are
+  // bound to several NUMA nodes, every node gets its own copy of the BVH
+  void build_bvh();
+  // Builds on a worker without blocking the caller
+  Async<> build_bvh_async();
+
+  // Takes effect after the next build_bvh
+  void add_primitive(std::shared_ptr<Shape> shape,
+                     std::shared_ptr<Surface> material) {
+    primitives.emplace_back(std::move(shape), std::move(material));
   }
 
   bool intersect(const Ray &ray, Intersection &isect) const;
 
+  // Position of a primitive in the order it was added, stable across BVH
+  // builds and replicas
+  uint32_t get_primitive_index(const Primitive *primitive) const {
+    return primitive - primitives.data();
+  }
+
+  bool has_area_lights() const { return !area_lights.empty(); }
+  const std::vector<AreaLight> &get_area_lights() const { return area_lights; }
+
+  // Chooses an area light by its importance at the shading point p with
+  // normal n, and samples a point on it. Occlusion is not tested
+  bool sample_area_light(const float3 &p, const float3 &n, Sampler &sampler,
+                         LightSample &ls) const;
+
+  // Solid angle density of sample_area_light producing the emissive hit isect
+  // found along ray, which starts at p
+  float area_light_pdf(const float3 &p, const float3 &n, const Ray &ray,
+                       const Intersection &isect) const;
+
   void add_point_light(float3 position, float3 irradiance) {
     point_lights.emplace_back(position, irradiance);
   }
@@ -63,14 +132,20 @@ public:
     sky_light_hdr_image = std::move(hdr_image);
   }
   bool has_sky_light() const { return sky_light; }
-  float3 get_sky_light(const float3 &world_dir) const;
+  // Radiance of the sky along world_dir. A footprint in radians averages it
+  // over a cone that wide, from the mip levels of an HDR sky
+  float3 get_sky_light(const float3 &world_dir, float footprint = 0.0f) const;
 
 private:
   std::vector<Primitive> primitives;
   std::vector<PointLight> point_lights;
+  std::vector<AreaLight> area_lights;
+  LightBVH light_bvh;
   bool sky_light;
   float3 sky_light_value;
   std::shared_ptr<HDRImage> sky_light_hdr_image;
   BVH bvh;
+  // Copies of bvh in the memory of each NUMA node, when there are several
+  std::vector<BVH> bvh_replicas;
 };
 } // namespace verdant
@@ -29,6 +29,7 @@ bool Sphere::intersect(const Ray &ray, Intersection &isect) const {
     isect.t = t0;
     float3 position = ray.origin + t0 * ray.dir;
     isect.normal = normalize(position - center);
+    isect.geometric_normal = isect.normal;
     return true;
   }
   return false;
@@ -36,6 +37,21 @@ bool Sphere::intersect(const Ray &ray, Intersection &isect) const {
 
 BBox3 Sphere::get_bounds() const { return {center - radius, center + radius}; }
 
+float Sphere::get_area() const { return 4 * M_PI * radius * radius; }
+
+void Sphere::sample_area(float u0, float u1, float3 &p, float3 &n) const {
+  float z = 1 - 2 * u0;
+  float r = sqrtf(std::max(0.0f, 1 - z * z));
+  float phi = 2 * M_PI * u1;
+  n = float3(r * cosf(phi), r * sinf(phi), z);
+  p = center + radius * n;
+}
+
+void Sphere::get_normal_cone(float3 &axis, float &cos_theta) const {
+  axis = float3(0, 0, 1);
+  cos_theta = -1.0f;
+}
+
 Triangle::Triangle(const float3 &p0, const float3 &p1, const float3 &p2) {
   pos[0] = p0;
   pos[1] = p1;
@@ -46,6 +62,7 @@ Triangle::Triangle(const float3 &p0, const float3 &p1, const float3 &p2) {
   float3 v = p2 - p0;
   float3 n = u.cross(v);
   n.normalize();
+  face_normal = n;
   normal[0] = normal[1] = normal[2] = n;
 }
 
@@ -59,6 +76,7 @@ bool Triangle::intersect(const Ray &ray, Intersection &isect) const {
   if (hit && t < isect.t) {
     isect.t = t;
     isect.normal = u * normal[0] + v * normal[1] + (1 - u - v) * normal[2];
+    isect.geometric_normal = face_normal;
     return true;
   }
   return false;
@@ -70,6 +88,38 @@ BBox3 Triangle::get_bounds() const {
   return b;
 }
 
+float Triangle::get_area() const {
+  return 0.5f * cross(pos[1] - pos[0], pos[2] - pos[0]).length();
+}
+
+void Triangle::sample_area(float u0, float u1, float3 &p, float3 &n) const {
+  // Uniform barycentrics by folding the unit square onto the triangle
+  float su0 = sqrtf(u0);
+  float b0 = 1 - su0;
+  float b1 = u1 * su0;
+  p = b0 * pos[0] + b1 * pos[1] + (1 - b0 - b1) * pos[2];
+  n = face_normal;
+}
+
+void Triangle::get_normal_cone(float3 &axis, float &cos_theta) const {
+  // Hits emit along the interpolated vertex normals and light samples along
+  // the face normal, so the cone has to hold all four. A cone narrower than
+  // a hemisphere also holds the blends of the vertex normals
+  axis = normal[0] + normal[1] + normal[2] + face_normal;
+  float length = axis.length();
+  if (length <= 0.0f) {
+    axis = face_normal;
+    cos_theta = -1.0f;
+    return;
+  }
+  axis /= length;
+  cos_theta = std::min({dot(axis, normal[0]), dot(axis, normal[1]),
+                        dot(axis, normal[2]), dot(axis, face_normal)});
+  if (cos_theta <= 0.0f) {
+    cos_theta = -1.0f;
+  }
+}
+
 bool Triangle::moller_trumbore(const Ray &ray, float *t, float *u,
                                float *v) const {
   float3 v0v1 = pos[1] - pos[0];
@@ -99,4 +149,16 @@ bool Triangle::moller_trumbore(const Ray &ray, float *t, float *u,
 }
 
 BBox3 LineSegment::get_bounds() const { throw "unimplemented"; }
+
+float LineSegment::get_area() const { return 0.0f; }
+
+void LineSegment::sample_area(float u0, float, float3 &p, float3 &n) const {
+  p = origin + u0 * dir;
+  n = float3::ZERO;
+}
+
+void LineSegment::get_normal_cone(float3 &axis, float &cos_theta) const {
+  axis = float3(0, 0, 1);
+  cos_theta = -1.0f;
+}
 } // namespace verdant
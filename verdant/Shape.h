@@ -10,6 +10,17 @@ public:
   // isect.t
   virtual bool intersect(const Ray &ray, Intersection &isect) const = 0;
   virtual BBox3 get_bounds() const = 0;
+
+  // Total surface area, used to convert area densities for light sampling
+  virtual float get_area() const = 0;
+
+  // Uniformly samples a point p on the surface given u0, u1 in [0, 1), and
+  // returns the geometric normal n at that point
+  virtual void sample_area(float u0, float u1, float3 &p, float3 &n) const = 0;
+
+  // A cone bounding all surface normals, given as its axis and the cosine of
+  // its half angle. A cosine of -1 means normals point everywhere
+  virtual void get_normal_cone(float3 &axis, float &cos_theta) const = 0;
 };
 
 class Sphere : public Shape {
@@ -19,6 +30,9 @@ public:
 
   bool intersect(const Ray &ray, Intersection &isect) const override;
   BBox3 get_bounds() const override;
+  float get_area() const override;
+  void sample_area(float u0, float u1, float3 &p, float3 &n) const override;
+  void get_normal_cone(float3 &axis, float &cos_theta) const override;
 
 private:
   float radius;
@@ -31,14 +45,21 @@ public:
 
   bool intersect(const Ray &ray, Intersection &isect) const override;
   BBox3 get_bounds() const override;
+  float get_area() const override;
+  void sample_area(float u0, float u1, float3 &p, float3 &n) const override;
+  void get_normal_cone(float3 &axis, float &cos_theta) const override;
 
   bool moller_trumbore(const Ray &ray, float *t, float *u, float *v) const;
 
 private:
   float3 pos[3];
+  // Vertex normals, interpolated for shading
   float3 normal[3];
+  float3 face_normal;
 };
 
+// A line has no area, so it is never an area light, even with an emissive
+// material
 class LineSegment : public Shape {
 public:
   LineSegment(float3 origin, float3 dir, float radius)
@@ -60,6 +81,9 @@ public:
   }
 
   BBox3 get_bounds() const override;
+  float get_area() const override;
+  void sample_area(float u0, float u1, float3 &p, float3 &n) const override;
+  void get_normal_cone(float3 &axis, float &cos_theta) const override;
 
   static bool line_line_closest_point(const float3 &O0, const float3 &D0,
                                       const float3 &O1, const float3 &D1,
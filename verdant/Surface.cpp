@@ -42,6 +42,13 @@ std::shared_ptr<Surface> Surface::create_specular(float3 c, float eta) {
   return m;
 }
 
+std::shared_ptr<Surface> Surface::create_emissive(float3 Le, float3 c) {
+  std::shared_ptr<Surface> m(new Surface(SurfaceKind::Lambert));
+  m->c = c;
+  m->emission = Le;
+  return m;
+}
+
 float3 Surface::f(const float3 &L, const float3 &V) const {
   if (is_delta()) {
     return float3::ZERO;
@@ -49,7 +56,7 @@ float3 Surface::f(const float3 &L, const float3 &V) const {
   return F_lambert(c);
 }
 
-float3 Surface::sample_f(UniformSampler &sampler, const float3 &V, float3 &L,
+float3 Surface::sample_f(Sampler &sampler, const float3 &V, float3 &L,
                          float &pdf) const {
   pdf = 1.0f;
   switch (kind) {
@@ -66,8 +73,8 @@ float3 Surface::sample_f(UniformSampler &sampler, const float3 &V, float3 &L,
   }
 }
 
-float3 Surface::sample_f_lambert(UniformSampler &sampler, const float3 &V,
-                                 float3 &L, float &pdf) const {
+float3 Surface::sample_f_lambert(Sampler &sampler, const float3 &V, float3 &L,
+                                 float &pdf) const {
   CosineWeightedHemisphereDistribution dist;
   auto [pdf2, L2] = dist.sample(sampler);
   L = L2;
@@ -75,7 +82,7 @@ float3 Surface::sample_f_lambert(UniformSampler &sampler, const float3 &V,
   return F_lambert(c);
 }
 
-float3 Surface::sample_f_reflection(UniformSampler &sampler, const float3 &V,
+float3 Surface::sample_f_reflection(Sampler &sampler, const float3 &V,
                                     float3 &L, float &pdf) const {
   // Specular reflection
   L = reflect(V, float3(0, 0, 1));
@@ -83,7 +90,7 @@ float3 Surface::sample_f_reflection(UniformSampler &sampler, const float3 &V,
   return c * Fr_dielectric(cosThetaT, etaI, etaT) / cosThetaT;
 }
 
-float3 Surface::sample_f_refraction(UniformSampler &sampler, const float3 &V,
+float3 Surface::sample_f_refraction(Sampler &sampler, const float3 &V,
                                     float3 &L, float &pdf) const {
   // Specular transmission
   bool entering = V.z() > 0.0f;
@@ -100,8 +107,8 @@ float3 Surface::sample_f_refraction(UniformSampler &sampler, const float3 &V,
   return c * (1 - Fr_dielectric(cosThetaT, etaA, etaB)) / cosThetaT;
 }
 
-float3 Surface::sample_f_glass(UniformSampler &sampler, const float3 &V,
-                               float3 &L, float &pdf) const {
+float3 Surface::sample_f_glass(Sampler &sampler, const float3 &V, float3 &L,
+                               float &pdf) const {
   bool entering = V.z() > 0.f;
   float etaA = entering ? etaI : etaT;
   float etaB = entering ? etaT : etaI;
@@ -120,8 +127,8 @@ float3 Surface::sample_f_glass(UniformSampler &sampler, const float3 &V,
   }
 }
 
-float3 Surface::sample_f_specular(UniformSampler &sampler, const float3 &V,
-                                  float3 &L, float &pdf) const {
+float3 Surface::sample_f_specular(Sampler &sampler, const float3 &V, float3 &L,
+                                  float &pdf) const {
   bool entering = V.z() > 0.f;
   float etaA = entering ? etaI : etaT;
   float etaB = entering ? etaT : etaI;
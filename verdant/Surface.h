@@ -17,12 +17,32 @@ public:
   static std::shared_ptr<Surface> create_refract(float3 c, float eta);
   static std::shared_ptr<Surface> create_glass(float3 c, float eta);
   static std::shared_ptr<Surface> create_specular(float3 c, float eta);
+  // Creates an area light emitting radiance Le from the front face, with
+  // diffuse reflectance c
+  static std::shared_ptr<Surface> create_emissive(float3 Le,
+                                                  float3 c = float3::ZERO);
+
+  // Any surface can emit light in addition to scattering it
+  void set_emission(float3 value) { emission = value; }
+  float3 get_emission() const { return emission; }
+  bool is_emissive() const {
+    return emission.x() > 0.0f || emission.y() > 0.0f || emission.z() > 0.0f;
+  }
+
+  // Reflectance color, for albedo outputs
+  float3 get_albedo() const { return c; }
+
+  // Radiance emitted towards world direction W from a point with normal N.
+  // Only the side the normal points to emits
+  float3 Le(const float3 &N, const float3 &W) const {
+    return dot(N, W) > 0.0f ? emission : float3::ZERO;
+  }
 
   // Both L and V are in BRDF coordinates, with normal being (0, 0, 1)
   float3 f(const float3 &L, const float3 &V) const;
 
   // Sample an incoming direction
-  float3 sample_f(UniformSampler &sampler, const float3 &V, float3 &L,
+  float3 sample_f(Sampler &sampler, const float3 &V, float3 &L,
                   float &pdf) const;
 
   bool is_delta() const {
@@ -31,20 +51,20 @@ public:
   }
 
 protected:
-  float3 sample_f_lambert(UniformSampler &sampler, const float3 &V, float3 &L,
+  float3 sample_f_lambert(Sampler &sampler, const float3 &V, float3 &L,
                           float &pdf) const;
-  float3 sample_f_reflection(UniformSampler &sampler, const float3 &V,
-                             float3 &L, float &pdf) const;
-  float3 sample_f_refraction(UniformSampler &sampler, const float3 &V,
-                             float3 &L, float &pdf) const;
-  float3 sample_f_glass(UniformSampler &sampler, const float3 &V, float3 &L,
+  float3 sample_f_reflection(Sampler &sampler, const float3 &V, float3 &L,
+                             float &pdf) const;
+  float3 sample_f_refraction(Sampler &sampler, const float3 &V, float3 &L,
+                             float &pdf) const;
+  float3 sample_f_glass(Sampler &sampler, const float3 &V, float3 &L,
                         float &pdf) const;
-  float3 sample_f_specular(UniformSampler &sampler, const float3 &V, float3 &L,
+  float3 sample_f_specular(Sampler &sampler, const float3 &V, float3 &L,
                            float &pdf) const;
 
   template <typename T1, typename T2>
-  float3 sum_f(UniformSampler &sampler, const float3 &V, float3 &L, float &pdf,
-               T1 fn1, T2 fn2) const {
+  float3 sum_f(Sampler &sampler, const float3 &V, float3 &L, float &pdf, T1 fn1,
+               T2 fn2) const {
     auto [_pdf, roll] = sampler.sample();
     const float k = 0.5f;
     if (roll < k) {
@@ -62,5 +82,6 @@ private:
   SurfaceKind kind;
   float3 c;
   float etaI, etaT;
+  float3 emission = float3::ZERO;
 };
 } // namespace verdant
@@ -1,23 +1,38 @@
 #include "Task.h"
 
 namespace verdant {
-Task::Task(std::function<void()> fn) : fn(std::move(fn)) {}
+SuccessorEdge Task::closed{nullptr, nullptr};
 
-void Task::add_successor(Task *succ) {
-  succ->prerequisite_count += 1;
-  successors.push_back(succ);
+Task::~Task() {
+  // Only tasks that never ran still have successors
+  SuccessorEdge *edge = successors.load(std::memory_order_relaxed);
+  while (edge && edge != &closed) {
+    SuccessorEdge *next = edge->next;
+    delete edge;
+    edge = next;
+  }
 }
 
-bool Task::decrement_successors() {
-  bool has_ready = false;
-  for (Task *succ : successors) {
-    succ->prerequisite_count -= 1;
-    if (succ->prerequisite_count == 0) {
-      has_ready = true;
+bool Task::add_successor(Task *succ) {
+  // Counted before the edge is visible, since finish may follow right away
+  succ->prerequisite_count.fetch_add(1);
+  SuccessorEdge *edge = new SuccessorEdge{succ, nullptr};
+  SuccessorEdge *head = successors.load();
+  do {
+    if (head == &closed) {
+      succ->prerequisite_count.fetch_sub(1);
+      delete edge;
+      return false;
     }
-  }
-  return has_ready;
+    edge->next = head;
+  } while (!successors.compare_exchange_weak(head, edge));
+  return true;
 }
 
-void Task::execute() { fn(); }
+void Task::execute() {
+  if (!is_cancelled()) {
+    fn();
+  }
+  fn.reset();
+}
 } // namespace verdant
@@ -1,26 +1,201 @@
 #pragma once
-#include <functional>
-#include <vector>
+#include "InlineFunction.h"
+#include "ObjectPool.h"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
 
 namespace verdant {
+class Task;
+
+// Ready tasks of higher priority are started first. Running tasks are never
+// interrupted
+enum class TaskPriority { High, Normal, Low };
+const int task_priority_count = 3;
+
+/**
+ * @brief Shared flag for cooperative cancellation. Copies observe the same
+ * flag. A default constructed token can never be cancelled and costs nothing
+ *
+ */
+class CancellationToken {
+public:
+  CancellationToken() = default;
+
+  static CancellationToken create() {
+    CancellationToken token;
+    token.state = std::make_shared<std::atomic<bool>>(false);
+    return token;
+  }
+
+  void cancel() const {
+    if (state) {
+      state->store(true);
+    }
+  }
+  bool is_cancelled() const {
+    return state && state->load(std::memory_order_relaxed);
+  }
+
+private:
+  std::shared_ptr<std::atomic<bool>> state;
+};
+
+struct TaskOptions {
+  TaskPriority priority = TaskPriority::Normal;
+  // Tasks whose token is cancelled before they start are skipped. They still
+  // finish, so that successors and waiting threads are released
+  CancellationToken token;
+};
+
+// Link of the intrusive successor list of a task
+struct SuccessorEdge {
+  Task *task;
+  SuccessorEdge *next;
+
+  static void *operator new(size_t) {
+    return ObjectPool<SuccessorEdge>::allocate();
+  }
+  static void operator delete(void *p) {
+    ObjectPool<SuccessorEdge>::deallocate(p);
+  }
+};
+
+/**
+ * @brief A unit of work with prerequisites. Tasks and their successor edges
+ * come from thread-local pools, and small callables are stored inline, so
+ * that scheduling does not touch the heap once the pools are warm
+ *
+ */
 class Task {
 public:
-  Task(std::function<void()> fn);
+  // Captures up to this size are stored inline
+  static const size_t inline_capacity = 64;
+
+  template <typename Fn>
+  explicit Task(Fn &&fn, TaskOptions options = {})
+      : fn(std::forward<Fn>(fn)), options(std::move(options)) {}
+  ~Task();
 
-  bool is_ready() const { return prerequisite_count == 0; }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
 
-  void add_successor(Task *succ);
+  static void *operator new(size_t) { return ObjectPool<Task>::allocate(); }
+  static void operator delete(void *p) { ObjectPool<Task>::deallocate(p); }
 
-  bool decrement_successors();
+  bool is_ready() const { return prerequisite_count.load() == 0; }
+  bool is_finished() const { return successors.load() == &closed; }
+  bool is_cancelled() const { return options.token.is_cancelled(); }
+  TaskPriority get_priority() const { return options.priority; }
+  // Set for tasks enqueued on a node, before they are scheduled
+  void set_node_bound() { node_bound = true; }
+  bool is_node_bound() const { return node_bound; }
 
+  // Makes succ wait for this task. Returns false without waiting if this task
+  // already finished. succ must hold back a prerequisite of its own meanwhile
+  bool add_successor(Task *succ);
+
+  void add_prerequisite() { prerequisite_count.fetch_add(1); }
+
+  // Counts down one prerequisite, returns true if that made the task ready
+  bool decrement_prerequisites() {
+    return prerequisite_count.fetch_sub(1) == 1;
+  }
+
+  // Marks the task finished, calls on_ready with every successor that became
+  // ready and wakes threads blocked in wait_finished
+  template <typename OnReady> void finish(OnReady &&on_ready) {
+    SuccessorEdge *edge = successors.exchange(&closed);
+    while (edge) {
+      SuccessorEdge *next = edge->next;
+      if (edge->task->decrement_prerequisites()) {
+        on_ready(edge->task);
+      }
+      delete edge;
+      edge = next;
+    }
+    successors.notify_all();
+  }
+
+  // Blocks the calling thread until the task finished
+  void wait_finished() const {
+    SuccessorEdge *edge = successors.load();
+    while (edge != &closed) {
+      // Also wakes up when a successor is added, then waits again
+      successors.wait(edge);
+      edge = successors.load();
+    }
+  }
+
+  // Gives the calling thread the right to run the task, once. A thread
+  // waiting for a ready task may run it while the task still sits in a
+  // queue, and whoever takes it from there later finds it claimed
+  bool claim() {
+    return !claimed.load(std::memory_order_relaxed) &&
+           !claimed.exchange(true, std::memory_order_acquire);
+  }
+
+  // Runs the callable once unless cancelled, and releases what it captured
   void execute();
 
+  // Intrusive reference count shared by TaskHandle and the queue. The task
+  // deletes itself when the last reference is released
+  void retain() { ref_count.fetch_add(1, std::memory_order_relaxed); }
+  void release() {
+    if (ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
   // For debugging
-  unsigned int get_prereq_count() const { return prerequisite_count; }
+  unsigned int get_prereq_count() const { return prerequisite_count.load(); }
+
+private:
+  // Terminates the successor list once the task finished, after which no
+  // successors can be added
+  static SuccessorEdge closed;
+
+  InlineFunction<inline_capacity> fn;
+  TaskOptions options;
+  // Lock-free stack of successors, pushed by add_successor
+  std::atomic<SuccessorEdge *> successors{nullptr};
+  std::atomic<unsigned int> prerequisite_count{0};
+  std::atomic<unsigned int> ref_count{1};
+  std::atomic<bool> claimed{false};
+  bool node_bound = false;
+};
+// Shared reference to a task, valid even after the task finished. Used to
+// wait on tasks and to check whether they are done
+class TaskHandle {
+public:
+  TaskHandle() = default;
+  // Takes over one reference held by the caller
+  explicit TaskHandle(Task *task) : task(task) {}
+
+  TaskHandle(const TaskHandle &other) : task(other.task) {
+    if (task) {
+      task->retain();
+    }
+  }
+  TaskHandle(TaskHandle &&other) noexcept : task(other.task) {
+    other.task = nullptr;
+  }
+  TaskHandle &operator=(TaskHandle other) {
+    std::swap(task, other.task);
+    return *this;
+  }
+  ~TaskHandle() {
+    if (task) {
+      task->release();
+    }
+  }
+
+  Task *get() const { return task; }
+  explicit operator bool() const { return task != nullptr; }
+  bool is_done() const { return task && task->is_finished(); }
 
 private:
-  std::function<void()> fn;
-  std::vector<Task *> successors;
-  unsigned int prerequisite_count = 0;
+  Task *task = nullptr;
 };
 } // namespace verdant
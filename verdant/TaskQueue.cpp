@@ -1,119 +1,461 @@
 #include "TaskQueue.h"
 #include "Task.h"
+#include "Trace.h"
 #include <algorithm>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
+namespace {
+// The queue and deque the current thread works for, if it is a worker
+struct WorkerContext {
+  verdant::TaskQueue *queue = nullptr;
+  unsigned int index = 0;
+  unsigned int node = 0;
+  // xorshift32 state for picking steal victims
+  uint32_t rng = 0x9e3779b9u;
+};
+
+thread_local WorkerContext worker_context;
+
+uint32_t next_victim(uint32_t &rng) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+} // namespace
+
 namespace verdant {
 TaskQueue &TaskQueue::default_queue() {
   static TaskQueue q;
   return q;
 }
 
-const Task *TaskQueue::enqueue(std::function<void()> fn) {
-  auto task = std::make_unique<Task>(std::move(fn));
-  const Task *task_handle = task.get();
+TaskHandle TaskQueue::submit(Task *task) {
+  // One reference for the returned handle, one for the queue until retired
+  task->retain();
+  outstanding.fetch_add(1);
 
-  std::unique_lock<std::mutex> lk(this_mut);
-  tasks.push_back(std::move(task));
-  cv_has_work.notify_one();
+  Trace::instant("enqueue", "task", (intptr_t)task);
+  if (debug_print) {
+    fprintf(stderr, "+Task %p Signalling\n", task);
+  }
+
+  schedule(task);
+  return TaskHandle(task);
+}
 
+TaskHandle TaskQueue::submit_on_node(unsigned int node, Task *task,
+                                     bool strict) {
+  task->retain();
+  outstanding.fetch_add(1);
+  task->set_node_bound();
+
+  Trace::instant("enqueue", "task", (intptr_t)task);
   if (debug_print) {
-    fprintf(stderr, "+Task %p Signalling\n", task_handle);
+    fprintf(stderr, "+Task %p on node %u\n", task, node);
   }
 
-  return task_handle;
+  schedule_on_node(task, node % max_nodes, strict);
+  return TaskHandle(task);
 }
 
-const Task *
-TaskQueue::enqueue_await_all(std::function<void()> fn,
-                             const std::vector<const Task *> prerequisites) {
-  auto task = std::make_unique<Task>(std::move(fn));
-  const Task *task_handle = task.get();
+TaskHandle
+TaskQueue::submit_await_all(Task *task,
+                            const std::vector<TaskHandle> &prerequisites) {
+  task->retain();
+  outstanding.fetch_add(1);
 
-  std::unique_lock<std::mutex> lk(this_mut);
-  for (const Task *prereq : prerequisites) {
-    for (const std::unique_ptr<Task> &source : tasks) {
-      if (source.get() == prereq) {
-        source->add_successor(task.get());
-      }
+  // Hold back one count while wiring so that the task cannot become ready
+  // before all prerequisites are registered
+  task->add_prerequisite();
+  for (const TaskHandle &prereq : prerequisites) {
+    if (prereq) {
+      prereq.get()->add_successor(task);
     }
+  }
 
-    for (Task *source : tasks_running) {
-      if (source == prereq) {
-        source->add_successor(task.get());
-      }
-    }
+  Trace::instant("enqueue", "task", (intptr_t)task);
+  if (debug_print) {
+    fprintf(stderr, "+Task %p with %u dependencies\n", task,
+            task->get_prereq_count() - 1);
   }
 
-  if (task->is_ready()) {
-    cv_has_work.notify_one();
+  if (task->decrement_prerequisites()) {
+    schedule(task);
   }
+  return TaskHandle(task);
+}
+
+TaskHandle TaskQueue::submit_held(Task *task) {
+  task->retain();
+  outstanding.fetch_add(1);
+  task->add_prerequisite();
 
+  Trace::instant("enqueue", "task", (intptr_t)task);
   if (debug_print) {
-    if (task->is_ready()) {
-      fprintf(stderr, "+Task %p Signalling\n", task_handle);
-    } else {
-      fprintf(stderr, "+Task %p with %u dependencies\n", task_handle,
-              task_handle->get_prereq_count());
-    }
+    fprintf(stderr, "+Task %p held\n", task);
   }
+  return TaskHandle(task);
+}
 
-  tasks.push_back(std::move(task));
-  return task_handle;
+void TaskQueue::release_hold(const TaskHandle &task) {
+  if (task.get()->decrement_prerequisites()) {
+    schedule(task.get());
+  }
 }
 
 void TaskQueue::enqueue_shutdown() {
-  std::unique_lock<std::mutex> lk(this_mut);
   shutdown = true;
-  cv_has_work.notify_all();
+  wake_workers(true);
 }
 
-std::unique_ptr<Task> TaskQueue::dequeue_task() {
-  std::unique_lock<std::mutex> lk(this_mut);
+void TaskQueue::wait(const TaskHandle &task) {
+  if (worker_context.queue == this ||
+      worker_count.load(std::memory_order_acquire) == 0) {
+    // Without workers the calling thread is the only one to run anything
+    while (!task.is_done()) {
+      if (Task *other = find_task()) {
+        run_task(other);
+      } else {
+        // The task runs on another thread
+        std::this_thread::yield();
+      }
+    }
+    return;
+  }
+
+  // Tasks bound to a node are left to its workers
+  Task *awaited = task.get();
+  if (!awaited->is_node_bound() && awaited->is_ready() && awaited->claim()) {
+    // The queue keeps its reference until it comes across the claimed task,
+    // so running it here takes one of its own
+    awaited->retain();
+    run_task(awaited);
+    return;
+  }
+  // The task runs on a worker. Short ones finish before blocking pays off
+  for (int spin = 0; spin < 64 && !task.is_done(); spin++) {
+    std::this_thread::yield();
+  }
+  awaited->wait_finished();
+}
 
-  // Find the first ready task
-  std::vector<std::unique_ptr<Task>>::iterator task_iter;
-  while (true) {
-    task_iter = std::find_if(tasks.begin(), tasks.end(),
-                             [](const auto &task) { return task->is_ready(); });
-    if (task_iter == tasks.end()) {
-      if (shutdown) {
-        // Drained all work, shutting down
-        return {};
+void TaskQueue::attach_worker(unsigned int node) {
+  node %= max_nodes;
+  std::unique_lock<std::mutex> lk(attach_mut);
+  unsigned int index;
+  if (!free_deques.empty()) {
+    // Deques of workers that left are empty and can be reused
+    index = free_deques.back();
+    free_deques.pop_back();
+    deque_nodes[index].store(node, std::memory_order_relaxed);
+  } else {
+    index = worker_count.load(std::memory_order_relaxed);
+    if (index == max_workers) {
+      fprintf(stderr, "More than %u workers attached to a task queue\n",
+              max_workers);
+      abort();
+    }
+    for (auto &deque : deques[index]) {
+      deque = std::make_unique<WorkStealingDeque>();
+    }
+    deque_nodes[index].store(node, std::memory_order_relaxed);
+    // Publishes the new deque to thieves
+    worker_count.store(index + 1, std::memory_order_release);
+  }
+
+  if (node + 1 > node_count.load()) {
+    node_count.store(node + 1);
+  }
+  node_counters[node].workers.fetch_add(1);
+
+  worker_context.queue = this;
+  worker_context.index = index;
+  worker_context.node = node;
+  worker_context.rng = 0x9e3779b9u * (index + 1);
+
+  attached++;
+  lk.unlock();
+  cv_attached.notify_all();
+}
+
+void TaskQueue::detach_worker() {
+  if (worker_context.queue != this) {
+    return;
+  }
+  std::unique_lock<std::mutex> lk(attach_mut);
+  free_deques.push_back(worker_context.index);
+  worker_context.queue = nullptr;
+  attached--;
+}
+
+void TaskQueue::wait_for_workers(unsigned int count) {
+  std::unique_lock<std::mutex> lk(attach_mut);
+  cv_attached.wait(lk, [&] { return attached >= count; });
+}
+
+unsigned int TaskQueue::current_node() {
+  return worker_context.queue ? worker_context.node : 0;
+}
+
+void TaskQueue::add_busy_time(double seconds) {
+  if (worker_context.queue == this) {
+    node_counters[worker_context.node].busy_ns.fetch_add(
+        (uint64_t)(seconds * 1e9), std::memory_order_relaxed);
+  }
+}
+
+TaskQueue::NodeStats TaskQueue::get_node_stats(unsigned int node) const {
+  const NodeCounters &c = node_counters[node % max_nodes];
+  return {c.workers.load(), c.tasks.load(), c.remote_tasks.load(),
+          c.busy_ns.load() * 1e-9};
+}
+
+void TaskQueue::InjectionQueue::push(Task *task) {
+  std::unique_lock<std::mutex> lk(mut);
+  size_t n = count.load(std::memory_order_relaxed);
+  if (n == ring.size()) {
+    // Unwrap into a ring twice the size
+    std::vector<Task *> larger(std::max<size_t>(64, ring.size() * 2));
+    for (size_t i = 0; i < n; i++) {
+      larger[i] = ring[(head + i) % ring.size()];
+    }
+    ring.swap(larger);
+    head = 0;
+  }
+  ring[(head + n) % ring.size()] = task;
+  count.fetch_add(1);
+}
+
+Task *TaskQueue::InjectionQueue::pop() {
+  if (count.load() == 0) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> lk(mut);
+  if (count.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+  Task *task = ring[head];
+  head = (head + 1) % ring.size();
+  count.fetch_sub(1);
+  return task;
+}
+
+void TaskQueue::schedule(Task *task) {
+  int priority = (int)task->get_priority();
+  ready_count[priority].fetch_add(1);
+  if (worker_context.queue == this) {
+    deques[worker_context.index][priority]->push(task);
+  } else {
+    injected[priority].push(task);
+  }
+  notify_sleepers();
+}
+
+void TaskQueue::schedule_on_node(Task *task, unsigned int node,
+                                 bool strict) {
+  int priority = (int)task->get_priority();
+  ready_count[priority].fetch_add(1);
+  if (strict) {
+    node_strict[node][priority].push(task);
+    // Waking a single sleeper may wake one of another node, which would go
+    // back to sleep without the task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load() > 0) {
+      wake_workers(true);
+    }
+    return;
+  }
+  if (worker_context.queue == this && worker_context.node == node) {
+    deques[worker_context.index][priority]->push(task);
+  } else {
+    node_injected[node][priority].push(task);
+  }
+  notify_sleepers();
+}
+
+void TaskQueue::notify_sleepers() {
+  // Pairs with the fence in dequeue_task: either a worker about to sleep sees
+  // the new task, or this sees the sleeper
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers.load() > 0) {
+    wake_workers(false);
+  }
+}
+
+Task *TaskQueue::find_task() {
+  for (int priority = 0; priority < task_priority_count; priority++) {
+    if (ready_count[priority].load() == 0) {
+      continue;
+    }
+    while (Task *task = find_task(priority)) {
+      ready_count[priority].fetch_sub(1);
+      if (task->claim()) {
+        return task;
       }
-      cv_has_work.wait(lk);
-    } else {
-      break;
+      // A waiting thread already ran it, drop the reference of the queue
+      task->release();
     }
   }
+  return nullptr;
+}
 
-  if (debug_print) {
-    fprintf(stderr, "*Task %p\n", (*task_iter).get());
+Task *TaskQueue::find_task(int priority) {
+  bool is_worker = worker_context.queue == this;
+  if (is_worker) {
+    if (Task *task = deques[worker_context.index][priority]->pop()) {
+      return task;
+    }
+    if (Task *task = node_strict[worker_context.node][priority].pop()) {
+      return task;
+    }
+    if (Task *task = node_injected[worker_context.node][priority].pop()) {
+      return task;
+    }
+  }
+
+  if (Task *task = injected[priority].pop()) {
+    return task;
+  }
+
+  if (Task *task = steal_task(is_worker, priority)) {
+    return task;
+  }
+
+  if (is_worker) {
+    // Rather run tasks bound to other nodes than idle
+    unsigned int nodes = node_count.load();
+    for (unsigned int node = 0; node < nodes; node++) {
+      if (node == worker_context.node) {
+        continue;
+      }
+      if (Task *task = node_injected[node][priority].pop()) {
+        node_counters[worker_context.node].remote_tasks.fetch_add(1);
+        return task;
+      }
+    }
+  }
+  return nullptr;
+}
+
+Task *TaskQueue::steal_task(bool is_worker, int priority) {
+  unsigned int count = worker_count.load(std::memory_order_acquire);
+  if (count == 0) {
+    return nullptr;
   }
 
-  auto result = std::move(*task_iter);
-  tasks.erase(task_iter);
-  tasks_running.insert(result.get());
-  return result;
+  // Visit every other deque once per pass starting from a random victim,
+  // first those on the same node, then the rest
+  unsigned int start = next_victim(worker_context.rng) % count;
+  unsigned int node = worker_context.node;
+  for (int pass = 0; pass < 2; pass++) {
+    for (unsigned int i = 0; i < count; i++) {
+      unsigned int victim = (start + i) % count;
+      if (is_worker && victim == worker_context.index) {
+        continue;
+      }
+      bool local =
+          deque_nodes[victim].load(std::memory_order_relaxed) == node;
+      if (local != (pass == 0)) {
+        continue;
+      }
+      if (Task *task = deques[victim][priority]->steal()) {
+        Trace::instant("steal", "victim", victim);
+        if (debug_print) {
+          fprintf(stderr, "~Task %p stolen from %u\n", task, victim);
+        }
+        if (is_worker && !local) {
+          node_counters[node].remote_tasks.fetch_add(1);
+        }
+        return task;
+      }
+    }
+  }
+  return nullptr;
 }
 
-void TaskQueue::retire_task(std::unique_ptr<Task> task) {
-  std::unique_lock<std::mutex> lk(this_mut);
-  tasks_running.erase(task.get());
-  bool has_ready = task->decrement_successors();
-  if (has_ready) {
+void TaskQueue::wake_workers(bool all) {
+  std::unique_lock<std::mutex> lk(sleep_mut);
+  if (all) {
+    cv_has_work.notify_all();
+  } else {
     cv_has_work.notify_one();
   }
+}
+
+Task *TaskQueue::dequeue_task() {
+  while (true) {
+    if (Task *task = find_task()) {
+      if (debug_print) {
+        fprintf(stderr, "*Task %p\n", task);
+      }
+      return task;
+    }
+
+    std::unique_lock<std::mutex> lk(sleep_mut);
+    sleepers.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // Look again now that producers know about this sleeper
+    Task *task = find_task();
+    // Running tasks may still enqueue more work, e.g. continuations
+    bool drained = shutdown && outstanding.load() == 0;
+    if (!task && !drained) {
+      TraceScope scope("sleep");
+      cv_has_work.wait(lk);
+    }
+    sleepers.fetch_sub(1);
+
+    if (task) {
+      if (debug_print) {
+        fprintf(stderr, "*Task %p\n", task);
+      }
+      return task;
+    }
+    if (drained) {
+      // Drained all work, shutting down
+      return nullptr;
+    }
+  }
+}
+
+void TaskQueue::run_task(Task *task) {
+  {
+    TraceScope scope("task", "task", (intptr_t)task);
+    task->execute();
+  }
+  retire_task(task);
+}
+
+void TaskQueue::retire_task(Task *task) {
+  bool signalled = false;
+  task->finish([this, &signalled](Task *succ) {
+    schedule(succ);
+    signalled = true;
+  });
 
   if (debug_print) {
-    if (!has_ready) {
-      fprintf(stderr, "-Task %p\n", task.get());
+    if (!signalled) {
+      fprintf(stderr, "-Task %p\n", task);
     } else {
-      fprintf(stderr, "-Task %p Signalling\n", task.get());
+      fprintf(stderr, "-Task %p Signalling\n", task);
     }
   }
+
+  if (worker_context.queue == this) {
+    node_counters[worker_context.node].tasks.fetch_add(
+        1, std::memory_order_relaxed);
+  }
+  task->release();
+  if (outstanding.fetch_sub(1) == 1 && shutdown) {
+    // Let idle workers see that all work is drained
+    wake_workers(true);
+  }
 }
 } // namespace verdant
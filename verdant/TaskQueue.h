@@ -1,10 +1,12 @@
 #pragma once
 #include "Task.h"
+#include "WorkStealingDeque.h"
+#include <atomic>
 #include <condition_variable>
-#include <functional>
+#include <cstdint>
 #include <memory>
 #include <mutex>
-#include <set>
+#include <utility>
 #include <vector>
 
 namespace verdant {
@@ -12,29 +14,172 @@ namespace verdant {
  * @brief A thread safe data structure to keep track of all pending tasks and
  * their dependencies
  *
+ * Every worker owns a work-stealing deque. Tasks that become ready on a worker
+ * are pushed onto its own deque, and idle workers steal from randomly chosen
+ * victims, so the ready-task path takes no lock. Tasks submitted by other
+ * threads go through a shared injection queue.
+ *
+ * Every worker has one deque per priority, as do the injection and node
+ * queues, and higher priorities are searched first everywhere.
+ *
+ * Workers may belong to NUMA nodes. Each node has its own queue for tasks
+ * bound to it, and workers steal from workers of their own node first.
+ *
  */
 class TaskQueue {
 public:
+  static const unsigned int max_nodes = 64;
+  // Workers that may be attached at the same time
+  static const unsigned int max_workers = 256;
+
+  struct NodeStats {
+    // Workers that ever attached to the node
+    unsigned int workers;
+    unsigned long long tasks;
+    // Tasks taken from the queue or a deque of another node
+    unsigned long long remote_tasks;
+    double busy_seconds;
+  };
+
   static TaskQueue &default_queue();
 
-  const Task *enqueue(std::function<void()> fn);
+  template <typename Fn>
+  TaskHandle enqueue(Fn &&fn, const TaskOptions &options = {}) {
+    return submit(new Task(std::forward<Fn>(fn), options));
+  }
 
-  const Task *enqueue_await_all(std::function<void()> fn,
-                                const std::vector<const Task *> prerequisites);
+  // Runs fn after all prerequisites finished. Prerequisites that already
+  // finished are satisfied immediately
+  template <typename Fn>
+  TaskHandle enqueue_await_all(Fn &&fn,
+                               const std::vector<TaskHandle> &prerequisites,
+                               const TaskOptions &options = {}) {
+    return submit_await_all(new Task(std::forward<Fn>(fn), options),
+                            prerequisites);
+  }
+
+  // Runs fn on a worker of node where possible. Workers of other nodes only
+  // take it when they find nothing else to do, and other threads never do.
+  // With strict, only workers of node ever run it, so node must have workers
+  template <typename Fn>
+  TaskHandle enqueue_on_node(unsigned int node, Fn &&fn,
+                             const TaskOptions &options = {},
+                             bool strict = false) {
+    return submit_on_node(node, new Task(std::forward<Fn>(fn), options),
+                          strict);
+  }
+
+  // Runs fn once release_hold was called for the returned task, for work that
+  // completes outside of the queue, such as coroutines
+  template <typename Fn>
+  TaskHandle enqueue_held(Fn &&fn, const TaskOptions &options = {}) {
+    return submit_held(new Task(std::forward<Fn>(fn), options));
+  }
+  void release_hold(const TaskHandle &task);
 
   void enqueue_shutdown();
 
-  // May sleep thread
-  std::unique_ptr<Task> dequeue_task();
+  // Returns once task finished. Workers run other ready tasks meanwhile, so
+  // that waiting never idles a thread that could be working. Other threads
+  // only run task itself, and through it the subtasks it waits for in turn,
+  // so that they never pick up unrelated work. Otherwise they block
+  void wait(const TaskHandle &task);
+
+  // Threads that take tasks from this queue, counting the calling thread
+  unsigned int get_concurrency() const {
+    return worker_count.load(std::memory_order_relaxed) + 1;
+  }
+
+  // Gives the calling thread its own deque on node. Must be called by a
+  // worker before dequeue_task, and paired with detach_worker
+  void attach_worker(unsigned int node = 0);
+  void detach_worker();
+  // Blocks until at least count workers are attached
+  void wait_for_workers(unsigned int count);
+
+  // Nodes up to the highest one a worker attached to, at least 1
+  unsigned int get_node_count() const { return node_count.load(); }
+  // Node of the calling worker, 0 on other threads
+  static unsigned int current_node();
 
-  void retire_task(std::unique_ptr<Task> task);
+  // Adds time the calling worker spent executing tasks to its node
+  void add_busy_time(double seconds);
+  NodeStats get_node_stats(unsigned int node) const;
+
+  // May sleep thread. Returns nullptr once shut down and drained
+  Task *dequeue_task();
+
+  // Executes a task returned by dequeue_task and retires it
+  void run_task(Task *task);
+  // Finishes a task returned by dequeue_task after executing it
+  void retire_task(Task *task);
 
 private:
-  std::mutex this_mut;
+  // FIFO ring buffer that only grows, so that it stops allocating once it
+  // is large enough
+  struct InjectionQueue {
+    std::mutex mut;
+    std::vector<Task *> ring;
+    size_t head = 0;
+    std::atomic<size_t> count{0};
+
+    void push(Task *task);
+    Task *pop();
+  };
+
+  struct alignas(64) NodeCounters {
+    std::atomic<unsigned int> workers{0};
+    std::atomic<uint64_t> tasks{0};
+    std::atomic<uint64_t> remote_tasks{0};
+    std::atomic<uint64_t> busy_ns{0};
+  };
+
+  // Take over a new task from the enqueue functions
+  TaskHandle submit(Task *task);
+  TaskHandle submit_await_all(Task *task,
+                              const std::vector<TaskHandle> &prerequisites);
+  TaskHandle submit_on_node(unsigned int node, Task *task, bool strict);
+  TaskHandle submit_held(Task *task);
+
+  // Makes a ready task available to workers
+  void schedule(Task *task);
+  void schedule_on_node(Task *task, unsigned int node, bool strict);
+  void notify_sleepers();
+  // Highest priority first. Within a priority the own deque first, then the
+  // queues of the own node, the injection queue, stealing within the node,
+  // stealing from other nodes and finally the queues of other nodes
+  Task *find_task();
+  Task *find_task(int priority);
+  Task *steal_task(bool is_worker, int priority);
+  void wake_workers(bool all);
+
+  // Per-worker deques, only ever appended to, up to worker_count
+  std::unique_ptr<WorkStealingDeque> deques[max_workers][task_priority_count];
+  std::atomic<unsigned int> deque_nodes[max_workers];
+  std::atomic<unsigned int> worker_count{0};
+  std::mutex attach_mut;
+  std::condition_variable cv_attached;
+  std::vector<unsigned int> free_deques;
+  // Workers attached now, guarded by attach_mut
+  unsigned int attached = 0;
+
+  InjectionQueue injected[task_priority_count];
+  InjectionQueue node_injected[max_nodes][task_priority_count];
+  // Tasks that only workers of the node may run. They never go to a deque,
+  // where workers of other nodes could steal them
+  InjectionQueue node_strict[max_nodes][task_priority_count];
+  // Ready tasks per priority, counted before they are pushed so that searches
+  // can skip empty priorities
+  std::atomic<size_t> ready_count[task_priority_count] = {};
+  std::atomic<unsigned int> node_count{1};
+  NodeCounters node_counters[max_nodes];
+
+  std::mutex sleep_mut;
   std::condition_variable cv_has_work;
-  std::vector<std::unique_ptr<Task>> tasks;
-  std::set<Task *> tasks_running;
-  bool shutdown = false;
+  std::atomic<unsigned int> sleepers{0};
+  // Enqueued tasks that have not retired yet
+  std::atomic<size_t> outstanding{0};
+  std::atomic<bool> shutdown{false};
   bool debug_print = false;
 };
 } // namespace verdant
@@ -1,42 +1,162 @@
 #include "TaskWorker.h"
 #include "TaskQueue.h"
+#include "Topology.h"
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <memory>
+#include <string>
 #include <thread>
 #include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace {
-const int worker_count = 4;
 std::vector<std::unique_ptr<verdant::TaskWorker>> default_workers;
+
+// CPUs granted by the cgroup CPU quota, 0 if there is no quota
+unsigned int cgroup_cpu_quota() {
+  double quota = -1.0, period = 0.0;
+
+  // cgroup v2: "<quota> <period>", or "max <period>" without a limit
+  std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+  if (cpu_max.is_open()) {
+    std::string quota_str;
+    cpu_max >> quota_str >> period;
+    if (quota_str != "max") {
+      quota = atof(quota_str.c_str());
+    }
+  } else {
+    // cgroup v1, where a quota of -1 means no limit
+    std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if (quota_file.is_open() && period_file.is_open()) {
+      quota_file >> quota;
+      period_file >> period;
+    }
+  }
+
+  if (quota <= 0.0 || period <= 0.0) {
+    return 0;
+  }
+  // A fractional CPU still deserves a thread
+  return std::max(1u, (unsigned int)ceil(quota / period));
+}
 } // namespace
 
 namespace verdant {
-TaskWorker::TaskWorker(TaskQueue &task_queue) : task_queue(task_queue) {
-  thread = std::thread(&TaskWorker::worker, this);
+TaskWorker::TaskWorker(TaskQueue &task_queue, std::vector<int> cpus,
+                       unsigned int node)
+    : task_queue(task_queue) {
+  thread = std::thread(&TaskWorker::worker, this, std::move(cpus), node);
 }
 
-void TaskWorker::init_default_workers() {
-  for (int i = 0; i < worker_count; i++) {
+void TaskWorker::init_default_workers(unsigned int count, bool pin,
+                                      bool numa) {
+  if (count == 0) {
+    count = available_concurrency();
+  }
+  TaskQueue &queue = TaskQueue::default_queue();
+  unsigned int room = TaskQueue::max_workers - default_workers.size();
+  if (count > room) {
+    fprintf(stderr, "Limiting the workers to %u\n", room);
+    count = room;
+  }
+
+  // CPUs ordered by node, so that spreading workers evenly over them gives
+  // each node a share proportional to its CPUs
+  std::vector<int> cpus;
+  std::vector<unsigned int> cpu_nodes;
+  const std::vector<NumaNode> &nodes = Topology::get_nodes();
+  for (unsigned int node = 0; node < nodes.size(); node++) {
+    for (int cpu : nodes[node].cpus) {
+      cpus.push_back(cpu);
+      cpu_nodes.push_back(numa ? node : 0);
+    }
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    std::vector<int> affinity;
+    unsigned int node = 0;
+    if (!cpus.empty()) {
+      // Spread workers evenly over the CPUs rather than fill one node first
+      size_t slot = count <= cpus.size() ? (size_t)i * cpus.size() / count
+                                         : i % cpus.size();
+      node = cpu_nodes[slot];
+      if (pin) {
+        affinity.push_back(cpus[slot]);
+      } else if (numa) {
+        affinity = nodes[node].cpus;
+      }
+    }
     default_workers.emplace_back(
-        std::make_unique<TaskWorker>(TaskQueue::default_queue()));
+        std::make_unique<TaskWorker>(queue, std::move(affinity), node));
   }
+  // Callers look at the attached workers and their nodes right away
+  queue.wait_for_workers(default_workers.size());
 }
 
 void TaskWorker::shutdown_default_workers() {
   TaskQueue::default_queue().enqueue_shutdown();
-  for (int i = 0; i < worker_count; i++) {
-    default_workers[i]->join();
+  for (auto &worker : default_workers) {
+    worker->join();
   }
   default_workers.clear();
 }
 
-void TaskWorker::worker() {
+unsigned int TaskWorker::get_default_worker_count() {
+  return default_workers.size();
+}
+
+unsigned int TaskWorker::available_concurrency() {
+  unsigned int count = std::thread::hardware_concurrency();
+  size_t affinity_count = Topology::get_allowed_cpus().size();
+  if (affinity_count > 0) {
+    count = count > 0 ? std::min<unsigned int>(count, affinity_count)
+                      : affinity_count;
+  }
+  unsigned int quota = cgroup_cpu_quota();
+  if (quota > 0) {
+    count = count > 0 ? std::min(count, quota) : quota;
+  }
+  return std::max(1u, count);
+}
+
+void TaskWorker::worker(std::vector<int> cpus, unsigned int node) {
+#ifdef __linux__
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+      fprintf(stderr, "Could not set the affinity of a worker\n");
+    }
+  }
+#endif
+
+  task_queue.attach_worker(node);
+  if (Trace::is_enabled()) {
+    Trace::set_thread_name("worker on node " + std::to_string(node));
+  }
   while (1) {
-    std::unique_ptr<Task> task = task_queue.dequeue_task();
+    Task *task = task_queue.dequeue_task();
     if (!task) {
       break;
     }
-    task->execute();
-    task_queue.retire_task(std::move(task));
+    auto start = std::chrono::steady_clock::now();
+    task_queue.run_task(task);
+    std::chrono::duration<double> busy =
+        std::chrono::steady_clock::now() - start;
+    task_queue.add_busy_time(busy.count());
   }
+  task_queue.detach_worker();
 }
 } // namespace verdant
@@ -1,19 +1,33 @@
 #pragma once
 #include "TaskQueue.h"
 #include <thread>
+#include <vector>
 
 namespace verdant {
 class TaskWorker {
 public:
-  TaskWorker(TaskQueue &task_queue);
+  // Restricts the worker to cpus unless empty, and attaches it to node
+  TaskWorker(TaskQueue &task_queue, std::vector<int> cpus = {},
+             unsigned int node = 0);
 
   void join() { thread.join(); }
 
-  static void init_default_workers();
+  // Starts count workers on the default queue, or one per available CPU when
+  // count is 0. With pin, workers are pinned round robin to the CPUs this
+  // process may run on. With numa, workers are spread over the NUMA nodes in
+  // proportion to their CPUs, and bound to their node. Returns once all of
+  // them are attached, so that node counts and stats already include them
+  static void init_default_workers(unsigned int count = 0, bool pin = false,
+                                   bool numa = false);
   static void shutdown_default_workers();
+  static unsigned int get_default_worker_count();
+
+  // CPUs this process may use, limited by its affinity mask and cgroup CPU
+  // quota. At least 1
+  static unsigned int available_concurrency();
 
 protected:
-  void worker();
+  void worker(std::vector<int> cpus, unsigned int node);
 
 private:
   std::thread thread;
@@ -0,0 +1,130 @@
+#include "ToneMapper.h"
+#include "Filter.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+// Pixels per block, small enough for the planes to stay in L1
+const size_t block_size = 64;
+
+// Linear values in [0, 1] are looked up at this resolution, which keeps the
+// error of the encoded values below one step of 8 bits
+const int srgb_lut_size = 4096;
+
+const std::array<uint8_t, srgb_lut_size> &srgb_lut() {
+  static const std::array<uint8_t, srgb_lut_size> lut = []() {
+    std::array<uint8_t, srgb_lut_size> table;
+    for (int i = 0; i < srgb_lut_size; i++) {
+      float linear = (float)i / (srgb_lut_size - 1);
+      float encoded = linear <= 0.0031308f
+                          ? 12.92f * linear
+                          : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+      table[i] = (uint8_t)std::clamp(encoded * 255.0f + 0.5f, 0.0f, 255.0f);
+    }
+    return table;
+  }();
+  return lut;
+}
+
+float hable(float x) {
+  const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f,
+              F = 0.30f;
+  return (x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F) - E / F;
+}
+} // namespace
+
+namespace verdant {
+void ToneMapper::apply_operator(float *values, size_t count) const {
+  switch (op) {
+  case ToneMapOperator::Reinhard:
+    for (size_t i = 0; i < count; i++) {
+      float x = values[i];
+      values[i] = x / (x + 1);
+    }
+    break;
+  case ToneMapOperator::Aces:
+    for (size_t i = 0; i < count; i++) {
+      // Narkowicz's fit of the ACES curve is made for input pre-exposed by
+      // 0.6, which matches the brightness of the reference transform
+      float x = values[i] * 0.6f;
+      values[i] = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+    }
+    break;
+  case ToneMapOperator::Filmic: {
+    const float white_scale = 1.0f / hable(11.2f);
+    for (size_t i = 0; i < count; i++) {
+      values[i] = hable(values[i] * 2.0f) * white_scale;
+    }
+    break;
+  }
+  }
+}
+
+void ToneMapper::map(const float *sums, const float *weights,
+                     const unsigned int *counts, size_t count,
+                     unsigned char *out, PixelLayout layout) const {
+  const std::array<uint8_t, srgb_lut_size> &lut = srgb_lut();
+  // Interleaved RGB, as the operators treat all channels alike
+  alignas(64) float values[block_size * 3];
+  alignas(64) int indices[block_size * 3];
+  alignas(64) uint8_t quantized[block_size * 3];
+  alignas(64) uint8_t bgra[block_size * 4];
+
+  for (size_t start = 0; start < count; start += block_size) {
+    size_t n = std::min(block_size, count - start);
+    const float *s = sums + start * 3;
+    const float *w = weights + start;
+    const unsigned int *c = counts + start;
+
+    for (size_t i = 0; i < n; i++) {
+      bool usable = is_weight_usable(w[i], c[i]);
+      float weight = usable ? w[i] : 1.0f;
+      float scale = usable ? exposure : 0.0f;
+      values[i * 3 + 0] = s[i * 3 + 0] / weight * scale;
+      values[i * 3 + 1] = s[i * 3 + 1] / weight * scale;
+      values[i * 3 + 2] = s[i * 3 + 2] / weight * scale;
+    }
+    apply_operator(values, n * 3);
+
+    // Scaling before clamping keeps selects next to the conversion, the form
+    // GCC and Clang vectorize. NaN becomes 0
+    if (srgb) {
+      const float scale = srgb_lut_size - 1;
+      for (size_t i = 0; i < n * 3; i++) {
+        float f = values[i] * scale + 0.5f;
+        f = f > 0.0f ? f : 0.0f;
+        f = f < scale ? f : scale;
+        indices[i] = (int)f;
+      }
+      for (size_t i = 0; i < n * 3; i++) {
+        quantized[i] = lut[indices[i]];
+      }
+    } else {
+      for (size_t i = 0; i < n * 3; i++) {
+        float f = values[i] * 255;
+        f = f > 0.0f ? f : 0.0f;
+        f = f < 255.0f ? f : 255.0f;
+        quantized[i] = (uint8_t)(int)f;
+      }
+    }
+
+    if (layout == PixelLayout::RGB) {
+      memcpy(out + start * 3, quantized, n * 3);
+    } else {
+      // Byte stores rather than packed words, so that the order does not
+      // depend on the host. The local block cannot alias the input, so the
+      // loop still vectorizes
+      for (size_t i = 0; i < n; i++) {
+        bgra[i * 4 + 0] = quantized[i * 3 + 2];
+        bgra[i * 4 + 1] = quantized[i * 3 + 1];
+        bgra[i * 4 + 2] = quantized[i * 3 + 0];
+        bgra[i * 4 + 3] = 255;
+      }
+      memcpy(out + start * 4, bgra, n * 4);
+    }
+  }
+}
+} // namespace verdant
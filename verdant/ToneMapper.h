@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+
+namespace verdant {
+enum class ToneMapOperator {
+  // x / (x + 1)
+  Reinhard,
+  // Narkowicz's fit of the ACES filmic curve
+  Aces,
+  // Hable's Uncharted 2 curve, with a white point of 11.2
+  Filmic
+};
+
+// Byte order of the 8 bit pixels written by ToneMapper
+enum class PixelLayout { RGB, BGRA };
+
+/**
+ * @brief Converts linear radiance to 8 bit display pixels. Pixels are mapped
+ * in blocks whose loops only use arithmetic and selects, so compilers turn
+ * them into SIMD code
+ *
+ * Without sRGB encoding, values are clamped to [0, 1] and scaled to 255
+ * with truncation. With sRGB, the transfer function is looked up in a table
+ * rather than evaluated with pow.
+ *
+ */
+class ToneMapper {
+public:
+  explicit ToneMapper(ToneMapOperator op = ToneMapOperator::Reinhard,
+                      bool srgb = false, float exposure = 1.0f)
+      : op(op), srgb(srgb), exposure(exposure) {}
+
+  ToneMapOperator get_operator() const { return op; }
+  bool get_srgb() const { return srgb; }
+  // Linear scale applied before the operator
+  float get_exposure() const { return exposure; }
+
+  /**
+   * @brief Maps count pixels given as weighted sums, like the film stores
+   * them, so that the radiance of pixel i is sums[3 * i .. 3 * i + 2] divided
+   * by weights[i]. Pixels whose weight is not usable are black, as in
+   * Film::get_radiance
+   *
+   * @param sums Interleaved RGB sums
+   * @param weights Weight per pixel
+   * @param counts Samples per pixel
+   * @param count Number of pixels
+   * @param out 3 or 4 bytes per pixel depending on layout
+   * @param layout Byte order of out, alpha is 255
+   */
+  void map(const float *sums, const float *weights,
+           const unsigned int *counts, size_t count, unsigned char *out,
+           PixelLayout layout) const;
+
+private:
+  // Maps a block of planar linear values in place
+  void apply_operator(float *values, size_t count) const;
+
+  ToneMapOperator op;
+  bool srgb;
+  float exposure;
+};
+} // namespace verdant
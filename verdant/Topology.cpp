@@ -0,0 +1,89 @@
+#include "Topology.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace {
+// Parses a kernel CPU list such as "0-3,8,10-11"
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    size_t dash = range.find('-');
+    int first = atoi(range.c_str());
+    int last = dash == std::string::npos ? first : atoi(&range[dash + 1]);
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<verdant::NumaNode> discover_nodes() {
+  std::vector<int> allowed = verdant::Topology::get_allowed_cpus();
+  std::vector<verdant::NumaNode> nodes;
+
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string online_list;
+  if (online.is_open() && std::getline(online, online_list)) {
+    for (int id : parse_cpu_list(online_list)) {
+      std::ifstream cpulist("/sys/devices/system/node/node" +
+                            std::to_string(id) + "/cpulist");
+      std::string list;
+      if (!cpulist.is_open() || !std::getline(cpulist, list)) {
+        continue;
+      }
+
+      verdant::NumaNode node{(unsigned int)id, {}};
+      for (int cpu : parse_cpu_list(list)) {
+        if (allowed.empty() ||
+            std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+          node.cpus.push_back(cpu);
+        }
+      }
+      // Memory-only nodes and nodes outside our cpuset are of no use
+      if (!node.cpus.empty()) {
+        nodes.push_back(std::move(node));
+      }
+    }
+  }
+
+  if (nodes.empty()) {
+    nodes.push_back({0, allowed});
+  }
+  return nodes;
+}
+} // namespace
+
+namespace verdant {
+std::vector<int> Topology::get_allowed_cpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+const std::vector<NumaNode> &Topology::get_nodes() {
+  static const std::vector<NumaNode> nodes = discover_nodes();
+  return nodes;
+}
+} // namespace verdant
@@ -0,0 +1,25 @@
+#pragma once
+#include <vector>
+
+namespace verdant {
+struct NumaNode {
+  // Node number of the operating system
+  unsigned int id;
+  // Usable CPUs of the node
+  std::vector<int> cpus;
+};
+
+/**
+ * @brief CPUs and NUMA nodes available to this process, read from sysfs on
+ * Linux. Machines without NUMA, and other platforms, report a single node
+ *
+ */
+class Topology {
+public:
+  // CPUs in the affinity mask of the process, empty if unknown
+  static std::vector<int> get_allowed_cpus();
+
+  // Nodes with at least one usable CPU, ordered by id. Never empty
+  static const std::vector<NumaNode> &get_nodes();
+};
+} // namespace verdant
@@ -0,0 +1,140 @@
+#include "Trace.h"
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+struct TraceEvent {
+  const char *name;
+  // 'X' for complete events, 'i' for instants
+  char phase;
+  uint64_t ts;
+  uint64_t dur;
+  const char *arg_names[2];
+  int64_t args[2];
+};
+
+struct ThreadBuffer {
+  unsigned int tid;
+  std::string thread_name;
+  std::vector<TraceEvent> events;
+};
+
+const auto clock_start = std::chrono::steady_clock::now();
+
+// Buffers outlive their threads, so that workers that already exited still
+// show up in the trace
+std::mutex registry_mut;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;
+unsigned int next_tid = 1;
+thread_local ThreadBuffer *local_buffer = nullptr;
+
+ThreadBuffer &thread_buffer() {
+  if (!local_buffer) {
+    auto buffer = std::make_unique<ThreadBuffer>();
+    // Keep growing the buffer out of most traces
+    buffer->events.reserve(1 << 14);
+    std::unique_lock<std::mutex> lk(registry_mut);
+    buffer->tid = next_tid++;
+    local_buffer = buffer.get();
+    registry.push_back(std::move(buffer));
+  }
+  return *local_buffer;
+}
+
+void write_args(FILE *f, const TraceEvent &e) {
+  if (!e.arg_names[0]) {
+    return;
+  }
+  fprintf(f, ",\"args\":{\"%s\":%" PRId64, e.arg_names[0], e.args[0]);
+  if (e.arg_names[1]) {
+    fprintf(f, ",\"%s\":%" PRId64, e.arg_names[1], e.args[1]);
+  }
+  fprintf(f, "}");
+}
+
+std::string escape(const std::string &s) {
+  std::string r;
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      r += '\\';
+    }
+    r += c;
+  }
+  return r;
+}
+} // namespace
+
+namespace verdant {
+std::atomic<bool> Trace::enabled{false};
+
+uint64_t Trace::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - clock_start)
+      .count();
+}
+
+void Trace::instant(const char *name, const char *arg_name, int64_t arg) {
+  if (!is_enabled()) {
+    return;
+  }
+  thread_buffer().events.push_back(
+      {name, 'i', now(), 0, {arg_name, nullptr}, {arg, 0}});
+}
+
+void Trace::complete(const char *name, uint64_t start, const char *arg0_name,
+                     int64_t arg0, const char *arg1_name, int64_t arg1) {
+  if (!is_enabled()) {
+    return;
+  }
+  uint64_t end = now();
+  thread_buffer().events.push_back(
+      {name, 'X', start, end - start, {arg0_name, arg1_name}, {arg0, arg1}});
+}
+
+void Trace::set_thread_name(const std::string &name) {
+  thread_buffer().thread_name = name;
+}
+
+bool Trace::write_chrome_json(const std::string &file_name) {
+  FILE *f = fopen(file_name.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Could not open file %s to write\n", file_name.c_str());
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lk(registry_mut);
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  for (const auto &buffer : registry) {
+    if (!buffer->thread_name.empty()) {
+      fprintf(f,
+              "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",\n", buffer->tid,
+              escape(buffer->thread_name).c_str());
+      first = false;
+    }
+    for (const TraceEvent &e : buffer->events) {
+      // Timestamps are in microseconds
+      fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,",
+              first ? "" : ",\n", e.name, e.phase, buffer->tid);
+      fprintf(f, "\"ts\":%.3f", e.ts / 1000.0);
+      if (e.phase == 'X') {
+        fprintf(f, ",\"dur\":%.3f", e.dur / 1000.0);
+      } else {
+        fprintf(f, ",\"s\":\"t\"");
+      }
+      write_args(f, e);
+      fprintf(f, "}");
+      first = false;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+} // namespace verdant
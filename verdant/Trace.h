@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace verdant {
+/**
+ * @brief Records scheduler and pipeline events into per-thread buffers, and
+ * writes them as Chrome trace JSON, which chrome://tracing and Perfetto open
+ *
+ * Recording is off by default, and then costs one relaxed load per event
+ * site. Names and argument names must be string literals, they are stored as
+ * pointers.
+ *
+ */
+class Trace {
+public:
+  static void set_enabled(bool enabled) { Trace::enabled.store(enabled); }
+  static bool is_enabled() {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  // Nanoseconds since the program started
+  static uint64_t now();
+
+  // An event without duration, such as a task being enqueued or stolen
+  static void instant(const char *name, const char *arg_name = nullptr,
+                      int64_t arg = 0);
+
+  // An event that started at start and ends now
+  static void complete(const char *name, uint64_t start,
+                       const char *arg0_name = nullptr, int64_t arg0 = 0,
+                       const char *arg1_name = nullptr, int64_t arg1 = 0);
+
+  // Names the calling thread in the trace
+  static void set_thread_name(const std::string &name);
+
+  // Writes the events of all threads. Threads should not be recording
+  // meanwhile. Returns false if the file could not be written
+  static bool write_chrome_json(const std::string &file_name);
+
+private:
+  static std::atomic<bool> enabled;
+};
+
+// Records the lifetime of the scope as a named phase
+class TraceScope {
+public:
+  explicit TraceScope(const char *name, const char *arg0_name = nullptr,
+                      int64_t arg0 = 0, const char *arg1_name = nullptr,
+                      int64_t arg1 = 0)
+      : name(Trace::is_enabled() ? name : nullptr), arg0_name(arg0_name),
+        arg1_name(arg1_name), arg0(arg0), arg1(arg1),
+        start(this->name ? Trace::now() : 0) {}
+
+  ~TraceScope() {
+    if (name) {
+      Trace::complete(name, start, arg0_name, arg0, arg1_name, arg1);
+    }
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  const char *name;
+  const char *arg0_name;
+  const char *arg1_name;
+  int64_t arg0;
+  int64_t arg1;
+  uint64_t start;
+};
+} // namespace verdant
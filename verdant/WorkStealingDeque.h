@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace verdant {
+class Task;
+
+/**
+ * @brief Chase-Lev work-stealing deque of tasks, with the memory orderings of
+ * Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+ * The owning thread pushes and pops at the bottom without locking, other
+ * threads steal from the top
+ *
+ */
+class WorkStealingDeque {
+public:
+  explicit WorkStealingDeque(int64_t capacity = 64)
+      : array(new Array(capacity)) {
+    garbage.emplace_back(array.load(std::memory_order_relaxed));
+  }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  // Owner only
+  void push(Task *task) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array *a = array.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      a = grow(a, b, t);
+    }
+    a->put(b, task);
+    // A release store rather than a release fence, which is equivalent here
+    // and also understood by ThreadSanitizer
+    bottom.store(b + 1, std::memory_order_release);
+  }
+
+  // Owner only. Returns the most recently pushed task, or nullptr
+  Task *pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      // Empty
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Task *task = a->get(b);
+    if (t == b) {
+      // Last task, race against thieves for it
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        task = nullptr;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // Any thread. Returns the least recently pushed task, or nullptr when empty
+  // or when losing a race with another thief or the owner
+  Task *steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+
+    Array *a = array.load(std::memory_order_acquire);
+    Task *task = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return task;
+  }
+
+  bool empty() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b <= t;
+  }
+
+private:
+  struct Array {
+    explicit Array(int64_t capacity)
+        : capacity(capacity), mask(capacity - 1),
+          slots(new std::atomic<Task *>[capacity]) {}
+
+    Task *get(int64_t i) const {
+      return slots[i & mask].load(std::memory_order_relaxed);
+    }
+    void put(int64_t i, Task *task) {
+      slots[i & mask].store(task, std::memory_order_relaxed);
+    }
+
+    int64_t capacity;
+    int64_t mask;
+    std::unique_ptr<std::atomic<Task *>[]> slots;
+  };
+
+  Array *grow(Array *a, int64_t b, int64_t t) {
+    Array *bigger = new Array(a->capacity * 2);
+    for (int64_t i = t; i < b; i++) {
+      bigger->put(i, a->get(i));
+    }
+    // Thieves may still be reading the old array, so it is only freed with
+    // the deque
+    garbage.emplace_back(bigger);
+    array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  alignas(64) std::atomic<int64_t> top{0};
+  alignas(64) std::atomic<int64_t> bottom{0};
+  std::atomic<Array *> array;
+  std::vector<std::unique_ptr<Array>> garbage;
+};
+} // namespace verdant